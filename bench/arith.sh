@@ -0,0 +1,27 @@
+#!/bin/bash
+# Arithmetic microbenchmarks: many (+ 1 2) calls, and sums of 1000 operands.
+#   bench/arith.sh [./hoagie] [extra hoagie options]
+HOAGIE=${1:-./hoagie}
+shift
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Counts n down by one per call, ending with (/ 0 0)
+cat > "$DIR/small.hg" <<'HG'
+(def {loop} (\ {n} {loop (- (+ n (+ 1 2)) (+ 3 (/ n n)))}))
+(loop 1000000)
+HG
+
+# The same, summing n and 999 zeros on the way
+ZEROS=$(for i in $(seq 999); do printf ' 0'; done)
+cat > "$DIR/wide.hg" <<HG
+(def {loop} (\\ {n} {loop (- (+ n$ZEROS) (/ n n))}))
+(loop 20000)
+HG
+
+for engine in tree vm; do
+  for bench in small wide; do
+    TIMEFORMAT="$(printf '%-5s %-6s' $engine $bench) %Rs"
+    time "$HOAGIE" --engine $engine "$@" "$DIR/$bench.hg" > /dev/null
+  done
+done
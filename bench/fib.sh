@@ -0,0 +1,18 @@
+#!/bin/bash
+# Call-heavy microbenchmark: naive recursive (fib n).
+#   bench/fib.sh [./hoagie] [n] [extra hoagie options]
+HOAGIE=${1:-./hoagie}
+N=${2:-27}
+shift 2
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat > "$DIR/fib.hg" <<HG
+(def {fib} (\\ {n} {if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))}))
+(fib $N)
+HG
+
+for engine in tree vm; do
+  TIMEFORMAT="$(printf '%-5s fib %-3s' $engine $N) %Rs"
+  time "$HOAGIE" --engine $engine "$@" "$DIR/fib.hg" > /dev/null
+done
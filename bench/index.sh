@@ -0,0 +1,32 @@
+#!/bin/bash
+# Indexed list access: summing a list of n numbers with nth, and with tail.
+#   bench/index.sh [./hoagie] [n] [extra hoagie options]
+HOAGIE=${1:-./hoagie}
+N=${2:-5000}
+shift 2
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+LIST=$(seq -s ' ' $N)
+
+# Reading element i of the list where it is bound
+cat > "$DIR/nth.hg" <<HG
+(def {xs} {$LIST})
+(def {s} 0)
+(dotimes {i} (len xs) {def {s} (+ s (nth i xs))})
+s
+HG
+
+# Taking the tail each time round, which copies what is left
+cat > "$DIR/tail.hg" <<HG
+(def {xs} {$LIST})
+(def {sum} (\\ {l acc} {if (== l {}) {acc} {sum (tail l) (+ acc (eval (head l)))}}))
+(sum xs 0)
+HG
+
+for engine in tree vm; do
+  for bench in nth tail; do
+    TIMEFORMAT="$(printf '%-5s %-5s %-6s' $engine $bench $N) %Rs"
+    time "$HOAGIE" --engine $engine "$@" "$DIR/$bench.hg" > /dev/null
+  done
+done
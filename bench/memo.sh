@@ -0,0 +1,34 @@
+#!/bin/bash
+# Memoization: naive Fibonacci with and without memo, and a long chain
+# of memoized calls that outgrows the default cache.
+#   bench/memo.sh [./hoagie] [extra hoagie options]
+HOAGIE=${1:-./hoagie}
+shift
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Two recursive calls per number, recomputing everything
+cat > "$DIR/plain.hg" <<'HG'
+(def {fib} (\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))
+(fib 30)
+HG
+
+# The same with its results remembered
+cat > "$DIR/memo.hg" <<'HG'
+(def {fib} (memo (\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})))
+(fib 30)
+HG
+
+# 10000 numbers deep, modulo a prime, with 1024 results kept and with all
+cat > "$DIR/evict.hg" <<'HG'
+(def {fib} (memo (\ {n} {if (< n 2) {n} {% (+ (fib (- n 1)) (fib (- n 2))) 1000000007}})))
+(fib 10000)
+HG
+sed 's/)))$/) 16384))/' "$DIR/evict.hg" > "$DIR/keep.hg"
+
+for engine in tree vm; do
+  for bench in plain memo evict keep; do
+    TIMEFORMAT="$(printf '%-5s %-6s' $engine $bench) %Rs"
+    time "$HOAGIE" --engine $engine "$@" "$DIR/$bench.hg" > /dev/null
+  done
+done
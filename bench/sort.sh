@@ -0,0 +1,55 @@
+#!/bin/bash
+# Sorting n random numbers and n random symbols, and sort-by on n pairs,
+# against an insertion sort written in hoagie on 300 numbers. Reading a
+# long list takes a while itself, so each list is timed loaded alone too.
+#   bench/sort.sh [./hoagie] [n] [extra hoagie options]
+HOAGIE=${1:-./hoagie}
+N=${2:-1000000}
+shift 2
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v n=$N 'BEGIN { srand(1); printf "(def {xs} {";
+  for (i = 0; i < n; i++) printf " %d", int(rand() * 2000000000) - 1000000000; print "})" }' \
+  > "$DIR/nums-load.hg"
+awk -v n=$N 'BEGIN { srand(2); printf "(def {xs} {";
+  for (i = 0; i < n; i++) printf " s%d", int(rand() * 1000000000); print "})" }' \
+  > "$DIR/syms-load.hg"
+SMALL=$(awk 'BEGIN { srand(3); for (i = 0; i < 300; i++) printf " %d", int(rand() * 1000000) }')
+
+cp "$DIR/nums-load.hg" "$DIR/nums.hg"
+cat >> "$DIR/nums.hg" <<HG
+(len (sort xs))
+(bsearch (nth 0 xs) (sort xs))
+HG
+
+cp "$DIR/syms-load.hg" "$DIR/syms.hg"
+cat >> "$DIR/syms.hg" <<HG
+(len (sort xs))
+(len (uniq (sort xs)))
+HG
+
+# Pairs of a key below 1000 and the number, sorted stably by key
+cp "$DIR/nums-load.hg" "$DIR/pairs-load.hg"
+cat >> "$DIR/pairs-load.hg" <<HG
+(def {ps} (map (\\ {x} {list (% x 1000) x}) xs))
+HG
+cp "$DIR/pairs-load.hg" "$DIR/pairs.hg"
+cat >> "$DIR/pairs.hg" <<HG
+(len (sort-by (\\ {p} {nth 0 p}) ps))
+(len (sort-by (\\ {p} {nth 0 p}) ps))
+HG
+
+cat > "$DIR/insert.hg" <<HG
+(def {insert} (\\ {x l} {
+  if (== l {}) {list x} {
+    if (<= x (nth 0 l)) {join (list x) l} {join (head l) (insert x (tail l))}}}))
+(len (fold (\\ {acc x} {insert x acc}) {} {$SMALL}))
+HG
+
+for engine in tree vm; do
+  for bench in nums-load nums syms-load syms pairs-load pairs insert; do
+    TIMEFORMAT="$(printf '%-5s %-10s' $engine $bench) %Rs"
+    time "$HOAGIE" --engine $engine "$@" "$DIR/$bench.hg" > /dev/null
+  done
+done
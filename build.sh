@@ -1,2 +1,7 @@
 #!/bin/bash
 cc -std=c99 -Wall hoagie.c mpc.c -lreadline -lm -o hoagie
+
+# Runtime for programs translated with 'hoagie --compile foo.hg -o foo.c':
+#   cc -std=c99 foo.c hoagie_rt.o mpc.o -lm -o foo
+cc -std=c99 -Wall -c -DHOAGIE_RUNTIME hoagie.c -o hoagie_rt.o
+cc -std=c99 -Wall -c mpc.c -o mpc.o
@@ -1,6 +1,20 @@
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(HOAGIE_NO_JIT)
+#define _DEFAULT_SOURCE
+#include <sys/mman.h>
+#define HOAGIE_JIT
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include "mpc.h"
+#include "hoagie.h"
 
-#ifdef _WIN32
+#ifdef HOAGIE_RUNTIME
+
+/* Compiled programs bring their own main and need no line editing */
+
+#elif defined(_WIN32)
 
 static char buffer[2048];
 
@@ -19,38 +33,13 @@ void add_history(char* unused) {}
 #include <editline/readline.h>
 #endif
 
-/* Forward Declarations */
-
-struct lval;
-struct lenv;
-typedef struct lval lval;
-typedef struct lenv lenv;
-
-/* Lisp Value */
-
-enum { LVAL_ERR, LVAL_NUM,   LVAL_SYM, 
-       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
-
-typedef lval*(*lbuiltin)(lenv*, lval*);
-
-struct lval {
-  int type;
-
-  // Basic
-  long num;
-  char* err;
-  char* sym;
-
-  // Function
-  lbuiltin builtin;
-  lenv* lenv;
-  lval* formals;
-  lval* body;
-
-  // Expression
-  int count;
-  lval** cell;
-};
+void lenv_del(lenv* e);
+lenv* lenv_retain(lenv* e);
+void lenv_release(lenv* e);
+void lchunk_retain(struct lchunk* c);
+void lchunk_release(struct lchunk* c);
+void lcache_retire(lval* fn);
+void lcache_flush(void);
 
 lval* lval_num(long x) {
   lval* v = malloc(sizeof(lval));
@@ -87,6 +76,10 @@ lval* lval_sym(char* s) {
   v->type = LVAL_SYM;
   v->sym = malloc(strlen(s) + 1);
   strcpy(v->sym, s);
+  v->depth = 0;
+  v->slot = -1;
+  v->global = NULL;
+  v->cached = NULL;
   return v;
 }
 
@@ -100,6 +93,9 @@ lval* lval_fun(lbuiltin func) {
 lval* lval_sexpr(void) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_SEXPR;
+  v->builtin = NULL;
+  v->form = NULL;
+  v->hash = 0;
   v->count = 0;
   v->cell = NULL;
   return v;
@@ -108,6 +104,9 @@ lval* lval_sexpr(void) {
 lval* lval_qexpr(void) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_QEXPR;
+  v->builtin = NULL;
+  v->form = NULL;
+  v->hash = 0;
   v->count = 0;
   v->cell = NULL;
   return v;
@@ -119,13 +118,16 @@ void lval_del(lval* v) {
     case LVAL_NUM: break;
     case LVAL_FUN: 
         if(!v->builtin) {
-            lenv_del(v->env);
-            lenv_del(v->formals);
-            lenv_del(v->body);
+            /* Formals and body belong to the shared chunk */
+            lenv_release(v->env);
+            lchunk_release(v->chunk);
         }
         break;
     case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
+    case LVAL_SYM:
+      free(v->sym);
+      if (v->cached) { lcache_retire(v->cached); }
+      break;
     case LVAL_QEXPR:
     case LVAL_SEXPR:
       for (int i = 0; i < v->count; i++) {
@@ -151,9 +153,12 @@ lval* lval_copy(lval* v) {
             x->builtin = v->builtin;
         } else {
             x->builtin = NULL;
-            x->env = lenv_copy(v->env);
-            x->formals = lenv_copy(v->formals);
-            x->body = lenv_copy(v->body);
+            /* Copies share the environment and the compiled body */
+            x->env = lenv_retain(v->env);
+            x->formals = v->formals;
+            x->body = v->body;
+            x->chunk = v->chunk;
+            lchunk_retain(x->chunk);
         }
         break;
     case LVAL_NUM: x->num = v->num; break;
@@ -165,11 +170,19 @@ lval* lval_copy(lval* v) {
       
     case LVAL_SYM:
       x->sym = malloc(strlen(v->sym) + 1);
-      strcpy(x->sym, v->sym); break;
+      strcpy(x->sym, v->sym);
+      x->depth = v->depth;
+      x->slot = v->slot;
+      x->global = v->global;
+      x->cached = NULL;
+      break;
     
     /* Copy Lists by copying each sub-expression */
     case LVAL_SEXPR:
     case LVAL_QEXPR:
+      x->builtin = v->builtin;
+      x->form = v->form;
+      x->hash = 0;
       x->count = v->count;
       x->cell = malloc(sizeof(lval*) * x->count);
       for (int i = 0; i < x->count; i++) {
@@ -260,29 +273,74 @@ char* ltype_name(int t) {
 /* Lisp Environment */
 
 struct lenv {
+  lenv* par;
   int count;
   char** syms;
   lval** vals;
+  
+  /* Room in syms and vals */
+  int size;
+  
+  /* Copies of a closure share its environment, as do frames of calls to it */
+  int refs;
+  
+  /*
+   * A call frame keeps the chunk of the lambda called alive, and its
+   * first borrowed symbols are the names of the formals in the chunk.
+   */
+  struct lchunk* chunk;
+  int borrowed;
+  
+  /* Results kept by the function made by memo this is the closure of */
+  struct lmemo* memo;
 };
 
 lenv* lenv_new(void) {
 
   /* Initialize struct */
   lenv* e = malloc(sizeof(lenv));
+  e->par = NULL;
   e->count = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->size = 0;
+  e->refs = 1;
+  e->chunk = NULL;
+  e->borrowed = 0;
+  e->memo = NULL;
   return e;
   
 }
 
+/* Call frames finished with, kept with their lists to be used again */
+#define LENV_POOL_SIZE 64
+
+lenv* lenv_pool[LENV_POOL_SIZE];
+int lenv_pool_count = 0;
+
+void lmemo_del(struct lmemo* m);
+
 void lenv_del(lenv* e) {
+  if (--e->refs > 0) { return; }
+  if (e->memo) { lmemo_del(e->memo); }
   
   /* Iterate over all items in environment deleting them */
   for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
+    if (i >= e->borrowed) { free(e->syms[i]); }
     lval_del(e->vals[i]);
   }
+  if (e->par) { lenv_release(e->par); }
+  
+  if (e->chunk) {
+    lchunk_release(e->chunk);
+    if (lenv_pool_count < LENV_POOL_SIZE) {
+      e->count = 0;
+      e->borrowed = 0;
+      e->chunk = NULL;
+      lenv_pool[lenv_pool_count++] = e;
+      return;
+    }
+  }
   
   /* Free allocated memory for lists */
   free(e->syms);
@@ -290,8 +348,36 @@ void lenv_del(lenv* e) {
   free(e);
 }
 
+/* Make room for one more symbol in e */
+void lenv_grow(lenv* e) {
+  if (e->count < e->size) { return; }
+  e->size = e->size ? e->size * 2 : 4;
+  e->vals = realloc(e->vals, sizeof(lval*) * e->size);
+  e->syms = realloc(e->syms, sizeof(char*) * e->size);
+}
+
+/*
+ * The global environment lives as long as the program, and everything
+ * else refers to it, so only frames are counted.
+ */
+lenv* lenv_retain(lenv* e) {
+  if (e->par) { e->refs++; }
+  return e;
+}
+
+void lenv_release(lenv* e) {
+  if (e->par) { lenv_del(e); }
+}
+
 lval* lenv_get(lenv* e, lval* k) {
   
+  /* Resolved symbols go straight to their frame and slot, or cell */
+  if (k->slot >= 0) {
+    for (int i = 0; i < k->depth; i++) { e = e->par; }
+    return lval_copy(e->vals[k->slot]);
+  }
+  if (k->global) { return lval_copy(k->global); }
+  
   /* Iterate over all items in environment */
   for (int i = 0; i < e->count; i++) {
     /* Check if the stored string matches the symbol string */
@@ -300,29 +386,62 @@ lval* lenv_get(lenv* e, lval* k) {
       return lval_copy(e->vals[i]);
     }
   }
-  /* If no symbol found return error */
+  
+  /* If no symbol found check in parent otherwise error */
+  if (e->par) { return lenv_get(e->par, k); }
   return lval_err("Unbound Symbol '%s'", k->sym);
 }
 
+/*
+ * Find the value bound to a symbol without copying it, or NULL. Unbound
+ * globals which something refers to have a cell holding the error that
+ * looking them up gives, which counts as unbound here.
+ */
+lval* lenv_peek(lenv* e, lval* k) {
+  lval* v = NULL;
+  if (k->slot >= 0) {
+    for (int i = 0; i < k->depth; i++) { e = e->par; }
+    v = e->vals[k->slot];
+  } else if (k->global) {
+    v = k->global;
+  } else {
+    for (int i = 0; i < e->count && !v; i++) {
+      if (strcmp(e->syms[i], k->sym) == 0) { v = e->vals[i]; }
+    }
+    if (!v) { return e->par ? lenv_peek(e->par, k) : NULL; }
+  }
+  return v->type == LVAL_ERR ? NULL : v;
+}
+
+/* Times a global has been redefined, which invalidates call site caches */
+long lenv_epoch = 0;
+
+/* Times a redefinition broke an assumption lambda bodies were simplified under */
+long lsimp_epoch = 0;
+
 void lenv_put(lenv* e, lval* k, lval* v) {
   
   /* Iterate over all items in environment */
   /* This is to see if variable already exists */
   for (int i = 0; i < e->count; i++) {
   
-    /* If variable is found delete item at that position */
-    /* And replace with variable supplied by user */
+    /* If variable is found replace the value in place, as the lval */
+    /* is the cell resolved references to a global point at */
     if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
+      /* Only functions are cached, so other values change freely */
+      if (!e->par && e->vals[i]->type == LVAL_FUN) { lenv_epoch++; lcache_flush(); }
+      lval* x = lval_copy(v);
+      lval old = *e->vals[i];
+      *e->vals[i] = *x;
+      *x = old;
+      lval_del(x);
       return;
     }
   }
   
   /* If no existing entry found allocate space for new entry */
+  lenv_grow(e);
   e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
   
   /* Copy contents of lval and symbol string into new location */
   e->vals[e->count-1] = lval_copy(v);
@@ -330,6 +449,115 @@ void lenv_put(lenv* e, lval* k, lval* v) {
   strcpy(e->syms[e->count-1], k->sym);
 }
 
+/* The cell of global k, made holding an unbound error if need be */
+lval* lenv_cell(lenv* g, lval* k) {
+  for (int i = 0; i < g->count; i++) {
+    if (strcmp(g->syms[i], k->sym) == 0) { return g->vals[i]; }
+  }
+  lval* err = lval_err("Unbound Symbol '%s'", k->sym);
+  lenv_put(g, k, err);
+  lval_del(err);
+  return g->vals[g->count-1];
+}
+
+/* The outermost environment, where def puts things */
+lenv* lenv_global(lenv* e) {
+  while (e->par) { e = e->par; }
+  return e;
+}
+
+/* Copy into c the binding in a frame of e of each free symbol in x */
+void lenv_capture_syms(lenv* c, lenv* e, lval* formals, lval* x) {
+  if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+    for (int i = 0; i < x->count; i++) {
+      lenv_capture_syms(c, e, formals, x->cell[i]);
+    }
+  }
+  if (x->type != LVAL_SYM) { return; }
+  for (int i = 0; i < formals->count; i++) {
+    if (strcmp(formals->cell[i]->sym, x->sym) == 0) { return; }
+  }
+  for (int i = 0; i < c->count; i++) {
+    if (strcmp(c->syms[i], x->sym) == 0) { return; }
+  }
+  for (; e->par; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], x->sym) == 0) { lenv_put(c, x, e->vals[i]); return; }
+    }
+  }
+}
+
+/*
+ * The environment for a lambda made in e. Rather than keep hold of
+ * every frame around it, a closure gets a flat environment holding
+ * just the local bindings its body mentions, taken by value, whose
+ * parent is the global environment. Symbols in nested Q-Expressions
+ * count, as they may be the bodies of lambdas made later. Lambdas
+ * using no locals need none, and share the global environment.
+ */
+lenv* lenv_capture(lenv* e, lval* formals, lval* body) {
+  if (!e->par) { return e; }
+  lenv* g = lenv_global(e);
+  lenv* c = lenv_new();
+  c->par = g;
+  lenv_capture_syms(c, e, formals, body);
+  if (c->count == 0) {
+    lenv_del(c);
+    return g;
+  }
+  return c;
+}
+
+/*
+ * Loop frames bind the variable of dotimes or for-each, in one slot
+ * every iteration reuses. dotimes counts in a number the slot owns,
+ * changed in place. for-each binds the elements of its list without
+ * copying them, as the list outlives the loop.
+ */
+lenv* lenv_loop(lenv* e, lval* var) {
+  lenv* l = lenv_new();
+  l->par = lenv_retain(e);
+  lenv_grow(l);
+  l->syms[0] = var->sym;
+  l->vals[0] = lval_num(0);
+  l->count = 1;
+  l->borrowed = 1;
+  return l;
+}
+
+/* Bind iteration i of loop frame l over src, or return 0 once it is done */
+int lenv_iterate(lenv* l, lval* src, long i) {
+  if (src->type == LVAL_NUM) {
+    if (i >= src->num) { return 0; }
+    l->vals[0]->num = i;
+    return 1;
+  }
+  if (i >= src->count) { return 0; }
+  if (i == 0) { lval_del(l->vals[0]); }
+  l->vals[0] = src->cell[i];
+  return 1;
+}
+
+/* Leave loop frame l over src after n iterations, returning its parent */
+lenv* lenv_unloop(lenv* l, lval* src, long n) {
+  lenv* e = l->par;
+  if (src->type == LVAL_QEXPR && n > 0) { l->count = 0; }
+  lenv_del(l);
+  return e;
+}
+
+int lsimp_assumed(lval* old, lval* v);
+
+void lenv_def(lenv* e, lval* k, lval* v) {
+  lenv* g = lenv_global(e);
+  lval* old = lenv_peek(g, k);
+  int assumed = old && lsimp_assumed(old, v);
+  lenv_put(g, k, v);
+  
+  /* Lambda bodies may have been simplified assuming k kept its value */
+  if (assumed) { lsimp_epoch++; }
+}
+
 /* Builtins */
 
 #define LASSERT(args, cond, fmt, ...) \
@@ -351,6 +579,13 @@ void lenv_put(lenv* e, lval* k, lval* v) {
 
 
 lval* lval_eval(lenv* e, lval* v);
+lval* lval_run(lenv* e, lval* v);
+
+/* Calls a builtin makes to one function, see lcall_run */
+typedef struct lcall lcall;
+lcall* lcall_new(lenv* e, lval* f);
+lval* lcall_run(lcall* c, lval** args, int n);
+void lcall_del(lcall* c);
 
 lval* builtin_list(lenv* e, lval* a) {
   a->type = LVAL_QEXPR;
@@ -383,7 +618,7 @@ lval* builtin_eval(lenv* e, lval* a) {
   
   lval* x = lval_take(a, 0);
   x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
+  return lval_run(e, x);
 }
 
 lval* builtin_join(lenv* e, lval* a) {
@@ -403,188 +638,5298 @@ lval* builtin_join(lenv* e, lval* a) {
   return x;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-  
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE(op, a, i, LVAL_NUM);
+/*
+ * Sorting. Lists of numbers are radix sorted a byte at a time, skipping
+ * bytes every number shares, and lists of symbols introsorted: quick
+ * sort, going over to heap sort if it recurses too deep, and insertion
+ * sort for short runs. Symbols are strings, so they compare as such.
+ * Both keep elements with equal keys in the order they were given.
+ */
+
+typedef struct {
+  /* A number key offset to sort unsigned, or for symbols the position */
+  unsigned long key;
+  char* sym;
+  lval* v;
+} lsortitem;
+
+#define LSORT_SIGN (1UL << 63)
+
+int lsort_less(lsortitem* x, lsortitem* y) {
+  if (x->sym) {
+    int c = strcmp(x->sym, y->sym);
+    if (c) { return c < 0; }
+  }
+  return x->key < y->key;
+}
+
+void lsort_insert(lsortitem* x, long n) {
+  for (long i = 1; i < n; i++) {
+    lsortitem t = x[i];
+    long j = i;
+    for (; j > 0 && lsort_less(&t, &x[j-1]); j--) { x[j] = x[j-1]; }
+    x[j] = t;
+  }
+}
+
+void lsort_sift(lsortitem* x, long i, long n) {
+  for (long c; (c = 2 * i + 1) < n; i = c) {
+    if (c + 1 < n && lsort_less(&x[c], &x[c+1])) { c++; }
+    if (!lsort_less(&x[i], &x[c])) { return; }
+    lsortitem t = x[i]; x[i] = x[c]; x[c] = t;
+  }
+}
+
+void lsort_heap(lsortitem* x, long n) {
+  for (long i = n / 2; i-- > 0;) { lsort_sift(x, i, n); }
+  while (--n > 0) {
+    lsortitem t = x[0]; x[0] = x[n]; x[n] = t;
+    lsort_sift(x, 0, n);
+  }
+}
+
+void lsort_intro(lsortitem* x, long n, int depth) {
+  while (n > 16) {
+    if (depth-- == 0) { lsort_heap(x, n); return; }
+    
+    /* Partition around the median of three, moved to the front */
+    long m = n / 2;
+    lsortitem t;
+    if (lsort_less(&x[m], &x[0])) { t = x[m]; x[m] = x[0]; x[0] = t; }
+    if (lsort_less(&x[n-1], &x[m])) { t = x[n-1]; x[n-1] = x[m]; x[m] = t; }
+    if (lsort_less(&x[m], &x[0])) { t = x[m]; x[m] = x[0]; x[0] = t; }
+    t = x[m]; x[m] = x[0]; x[0] = t;
+    
+    long i = 0, j = n;
+    for (;;) {
+      do { i++; } while (i < n && lsort_less(&x[i], &x[0]));
+      do { j--; } while (lsort_less(&x[0], &x[j]));
+      if (i >= j) { break; }
+      t = x[i]; x[i] = x[j]; x[j] = t;
+    }
+    t = x[0]; x[0] = x[j]; x[j] = t;
+    
+    /* Recurse into the smaller side, carrying on with the larger */
+    if (j < n - j - 1) {
+      lsort_intro(x, j, depth);
+      x += j + 1;
+      n -= j + 1;
+    } else {
+      lsort_intro(x + j + 1, n - j - 1, depth);
+      n = j;
+    }
+  }
+  lsort_insert(x, n);
+}
+
+void lsort_radix(lsortitem* x, long n) {
+  lsortitem* from = x;
+  lsortitem* to = malloc(sizeof(lsortitem) * n);
+  for (int shift = 0; shift < 64; shift += 8) {
+    long at[257] = { 0 };
+    for (long i = 0; i < n; i++) { at[((from[i].key >> shift) & 255) + 1]++; }
+    if (at[((from[0].key >> shift) & 255) + 1] == n) { continue; }
+    for (int b = 0; b < 256; b++) { at[b+1] += at[b]; }
+    for (long i = 0; i < n; i++) { to[at[(from[i].key >> shift) & 255]++] = from[i]; }
+    lsortitem* t = from; from = to; to = t;
+  }
+  if (from != x) {
+    memcpy(x, from, sizeof(lsortitem) * n);
+    to = from;
+  }
+  free(to);
+}
+
+/*
+ * Sort the cells of l by keys, a list of the same length which may be
+ * l itself, for func. Keys must be all numbers or all symbols. Takes
+ * both lists, returning l sorted or an error.
+ */
+lval* lval_sort(lval* l, lval* keys, char* func) {
+  int type = l->count ? keys->cell[0]->type : LVAL_NUM;
+  lval* err = NULL;
+  for (int i = 0; i < keys->count && !err; i++) {
+    int t = keys->cell[i]->type;
+    if (t != LVAL_NUM && t != LVAL_SYM) {
+      err = lval_err("Function '%s' cannot order %s.", func, ltype_name(t));
+    } else if (t != type) {
+      err = lval_err("Function '%s' cannot order %s with %s.",
+        func, ltype_name(type), ltype_name(t));
+    }
+  }
+  if (err) {
+    if (keys != l) { lval_del(keys); }
+    lval_del(l);
+    return err;
   }
   
-  lval* x = lval_pop(a, 0);
+  long n = l->count;
+  lsortitem* x = malloc(sizeof(lsortitem) * n);
+  for (long i = 0; i < n; i++) {
+    lval* k = keys->cell[i];
+    x[i].v = l->cell[i];
+    x[i].sym = type == LVAL_SYM ? k->sym : NULL;
+    x[i].key = type == LVAL_SYM ? (unsigned long)i : (unsigned long)k->num ^ LSORT_SIGN;
+  }
   
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
+  if (n < 32) {
+    lsort_insert(x, n);
+  } else if (type == LVAL_NUM) {
+    lsort_radix(x, n);
+  } else {
+    int depth = 0;
+    for (long m = n; m > 1; m >>= 1) { depth += 2; }
+    lsort_intro(x, n, depth);
   }
   
-  while (a->count > 0) {  
-    lval* y = lval_pop(a, 0);
-    
-    if (strcmp(op, "+") == 0) { x->num += y->num; }
-    if (strcmp(op, "-") == 0) { x->num -= y->num; }
-    if (strcmp(op, "*") == 0) { x->num *= y->num; }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x); lval_del(y);
-        x = lval_err("Division By Zero.");
-        break;
-      }
-      x->num /= y->num;
+  for (long i = 0; i < n; i++) { l->cell[i] = x[i].v; }
+  free(x);
+  if (keys != l) { lval_del(keys); }
+  return l;
+}
+
+lval* builtin_sort(lenv* e, lval* a) {
+  LASSERT_NUM("sort", a, 1);
+  LASSERT_TYPE("sort", a, 0, LVAL_QEXPR);
+  
+  lval* l = lval_take(a, 0);
+  return lval_sort(l, l, "sort");
+}
+
+/* Sort by the key function a->cell[0] gives each element, called once on each */
+lval* builtin_sort_by(lenv* e, lval* a) {
+  LASSERT_NUM("sort-by", a, 2);
+  LASSERT_TYPE("sort-by", a, 0, LVAL_FUN);
+  LASSERT_TYPE("sort-by", a, 1, LVAL_QEXPR);
+  
+  lval* list = a->cell[1];
+  lval* keys = lval_qexpr();
+  keys->cell = malloc(sizeof(lval*) * list->count);
+  lcall* c = lcall_new(e, a->cell[0]);
+  for (int i = 0; i < list->count; i++) {
+    lval* x = lval_copy(list->cell[i]);
+    x = lcall_run(c, &x, 1);
+    if (x->type == LVAL_ERR) {
+      lval_del(keys);
+      lcall_del(c);
+      lval_del(a);
+      return x;
     }
-    if (strcmp(op, "%") == 0) {
-      if (y->num == 0) {
-        lval_del(x); lval_del(y);
-        x = lval_err("Division By Zero.");
-        break;
-      }
-      x->num = fmod(x->num, y->num);
+    keys->cell[keys->count++] = x;
+  }
+  lcall_del(c);
+  
+  lval* l = lval_take(a, 1);
+  return lval_sort(l, keys, "sort-by");
+}
+
+int lval_eq(lval* x, lval* y);
+
+/* Drop each element equal to the one before it */
+lval* builtin_uniq(lenv* e, lval* a) {
+  LASSERT_NUM("uniq", a, 1);
+  LASSERT_TYPE("uniq", a, 0, LVAL_QEXPR);
+  
+  lval* v = lval_take(a, 0);
+  int n = 0;
+  for (int i = 0; i < v->count; i++) {
+    if (n && lval_eq(v->cell[n-1], v->cell[i])) {
+      lval_del(v->cell[i]);
+    } else {
+      v->cell[n++] = v->cell[i];
     }
-    
-    lval_del(y);
   }
+  v->count = n;
+  return v;
+}
+
+/*
+ * Index of the first element of sorted list l equal to x, -1 if there
+ * is none, or -2 if an element it meets is not the same type as x.
+ */
+long lval_bsearch(lval* x, lval* l) {
+  long lo = 0, hi = l->count;
+  while (lo < hi) {
+    long m = lo + (hi - lo) / 2;
+    lval* y = l->cell[m];
+    if (y->type != x->type) { return -2; }
+    int less = x->type == LVAL_NUM ? y->num < x->num : strcmp(y->sym, x->sym) < 0;
+    if (less) { lo = m + 1; } else { hi = m; }
+  }
+  if (lo == l->count) { return -1; }
+  lval* y = l->cell[lo];
+  if (y->type != x->type) { return -2; }
+  return (x->type == LVAL_NUM ? y->num == x->num : strcmp(y->sym, x->sym) == 0) ? lo : -1;
+}
+
+lval* builtin_bsearch(lenv* e, lval* a) {
+  LASSERT_NUM("bsearch", a, 2);
+  LASSERT(a, a->cell[0]->type == LVAL_NUM || a->cell[0]->type == LVAL_SYM,
+    "Function 'bsearch' passed incorrect type for argument 0. "
+    "Got %s, Expected %s or %s.", ltype_name(a->cell[0]->type),
+    ltype_name(LVAL_NUM), ltype_name(LVAL_SYM));
+  LASSERT_TYPE("bsearch", a, 1, LVAL_QEXPR);
+  
+  long i = lval_bsearch(a->cell[0], a->cell[1]);
+  LASSERT(a, i != -2, "Function 'bsearch' cannot search a list of %s for %s.",
+    ltype_name(a->cell[0]->type == LVAL_NUM ? LVAL_SYM : LVAL_NUM),
+    ltype_name(a->cell[0]->type));
+  lval_del(a);
+  return lval_num(i);
+}
+
+/*
+ * Reading a list by index. Apart from freeing the list they are given,
+ * these take the same time however long it is.
+ */
+
+lval* builtin_len(lenv* e, lval* a) {
+  LASSERT_NUM("len", a, 1);
+  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
   
+  lval* x = lval_num(a->cell[0]->count);
   lval_del(a);
   return x;
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+lval* builtin_nth(lenv* e, lval* a) {
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->num >= 0 && a->cell[0]->num < a->cell[1]->count,
+    "Function 'nth' passed index %li for a list of %i.",
+    a->cell[0]->num, a->cell[1]->count);
+  
+  long i = a->cell[0]->num;
+  return lval_take(lval_take(a, 1), i);
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+lval* builtin_last(lenv* e, lval* a) {
+  LASSERT_NUM("last", a, 1);
+  LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("last", a, 0);
+  
+  lval* v = lval_take(a, 0);
+  return lval_take(v, v->count-1);
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+/* (slice i j l) is the elements of l from i up to j, as many as it has */
+lval* builtin_slice(lenv* e, lval* a) {
+  LASSERT_NUM("slice", a, 3);
+  LASSERT_TYPE("slice", a, 0, LVAL_NUM);
+  LASSERT_TYPE("slice", a, 1, LVAL_NUM);
+  LASSERT_TYPE("slice", a, 2, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->num >= 0 && a->cell[1]->num >= 0,
+    "Function 'slice' passed negative index %li.",
+    a->cell[0]->num < 0 ? a->cell[0]->num : a->cell[1]->num);
+  
+  long i = a->cell[0]->num;
+  long j = a->cell[1]->num;
+  lval* v = lval_take(a, 2);
+  if (j > v->count) { j = v->count; }
+  if (i > j) { i = j; }
+  for (long k = 0; k < v->count; k++) {
+    if (k < i || k >= j) { lval_del(v->cell[k]); }
+  }
+  memmove(v->cell, v->cell + i, sizeof(lval*) * (j - i));
+  v->count = j - i;
+  return v;
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+/*
+ * The same readers on a list they do not own, copying out only what
+ * they give. Each returns NULL if its arguments do not suit the list,
+ * leaving the builtin to give the error.
+ */
+
+lval* lread_len(lval** x, lval* l) {
+  return lval_num(l->count);
 }
 
-lval* builtin_mod(lenv* e, lval* a) {
-  return builtin_op(e, a, "%");
+lval* lread_nth(lval** x, lval* l) {
+  if (x[0]->type != LVAL_NUM || x[0]->num < 0 || x[0]->num >= l->count) {
+    return NULL;
+  }
+  return lval_copy(l->cell[x[0]->num]);
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+lval* lread_last(lval** x, lval* l) {
+  return l->count ? lval_copy(l->cell[l->count-1]) : NULL;
+}
 
-    // Set Builtin to NULL
-    v->builtin = NULL;
+lval* lread_bsearch(lval** x, lval* l) {
+  if (x[0]->type != LVAL_NUM && x[0]->type != LVAL_SYM) { return NULL; }
+  long i = lval_bsearch(x[0], l);
+  return i == -2 ? NULL : lval_num(i);
+}
 
-    // Build new environment
-    v->env = lenv_new();
+unsigned long lval_hash(lval* x);
 
-    // Set Formals and body
-    v->formals = formals;
-    v->body = body;
-    return v;
+/* Hashing a value where it is bound keeps its hash there for next time */
+lval* lread_hash(lval** x, lval* l) {
+  return lval_num((long)(lval_hash(l) >> 1));
 }
 
-lval* builtin_def(lenv* e, lval* a) {
+lval* lread_slice(lval** x, lval* l) {
+  if (x[0]->type != LVAL_NUM || x[1]->type != LVAL_NUM
+      || x[0]->num < 0 || x[1]->num < 0) {
+    return NULL;
+  }
+  long j = x[1]->num < l->count ? x[1]->num : l->count;
+  long i = x[0]->num < j ? x[0]->num : j;
+  lval* v = lval_qexpr();
+  v->cell = malloc(sizeof(lval*) * (j - i));
+  for (long k = i; k < j; k++) { v->cell[v->count++] = lval_copy(l->cell[k]); }
+  return v;
+}
 
-  LASSERT_TYPE("def", a, 0, LVAL_QEXPR);
-  
-  /* First argument is symbol list */
-  lval* syms = a->cell[0];
-  
-  /* Ensure all elements of first list are symbols */
-  for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-      "Function 'def' cannot define non-symbol. "
-      "Got %s, Expected %s.",
-      ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+typedef struct {
+  lbuiltin fn;
+  int args;
+  int list;
+  lval* (*read)(lval** x, lval* l);
+} lreader;
+
+/* builtin, arguments before the value, does it take only lists, reader */
+lreader lreaders[] = {
+  { builtin_len, 0, 1, lread_len }, { builtin_nth, 1, 1, lread_nth },
+  { builtin_last, 0, 1, lread_last }, { builtin_slice, 2, 1, lread_slice },
+  { builtin_bsearch, 1, 1, lread_bsearch }, { builtin_hash, 0, 0, lread_hash },
+  { NULL, 0, 0, NULL }
+};
+
+lreader* lreader_of(lbuiltin f) {
+  for (lreader* r = lreaders; f && r->fn; r++) {
+    if (r->fn == f) { return r; }
   }
-  
-  /* Check correct number of symbols and values */
-  LASSERT(a, (syms->count == a->count-1),
-    "Function 'def' passed too many arguments for symbols. "
-    "Got %i, Expected %i.",
-    syms->count, a->count-1);
-  
-  /* Assign copies of values to symbols */
-  for (int i = 0; i < syms->count; i++) {
-    lenv_put(e, syms->cell[i], a->cell[i+1]);
+  return NULL;
+}
+
+/*
+ * A reader called on a variable, which lval_resolve turns from
+ *
+ *   (nth i xs)
+ *
+ * into a call to builtin_ref with the names of both quoted first:
+ *
+ *   (<builtin> {nth xs} i)
+ *
+ * The list is read where it is bound, rather than copied to be passed
+ * in, so indexing every element of a list takes linear time instead of
+ * quadratic. If the name no longer gives a reader, or the arguments do
+ * not suit the list, the call is made as written instead.
+ */
+lval* builtin_ref(lenv* e, lval* a) {
+  lval* names = a->cell[0];
+  lval* f = lenv_peek(e, names->cell[0]);
+  lval* l = lenv_peek(e, names->cell[1]);
+  lreader* r = f && f->type == LVAL_FUN ? lreader_of(f->builtin) : NULL;
+  if (r && l && (l->type == LVAL_QEXPR || !r->list)) {
+    lval* x = r->read(a->cell + 1, l);
+    if (x) { lval_del(a); return x; }
   }
   
+  int n = a->count;
+  lval** base = malloc(sizeof(lval*) * (n + 1));
+  base[0] = lenv_get(e, names->cell[0]);
+  for (int i = 1; i < n; i++) { base[i] = a->cell[i]; }
+  base[n] = lenv_get(e, names->cell[1]);
+  a->count = 1;
   lval_del(a);
-  return lval_sexpr();
+  
+  lval* x = lvm_call(e, base, n);
+  free(base);
+  return x;
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-  lval* k = lval_sym(name);
-  lval* v = lval_fun(func);
-  lenv_put(e, k, v);
-  lval_del(k); lval_del(v);
+/*
+ * Higher order list functions. Each walks the cells of its list in
+ * place, moving them out rather than copying them where the function
+ * can have them, and calls the function through an lcall.
+ */
+
+/* Free what a walk over list, held by a, left from cell i, and return x */
+lval* lval_walked(lval* a, lval* list, int i, lcall* c, lval* x) {
+  for (int j = i; j < list->count; j++) { lval_del(list->cell[j]); }
+  list->count = 0;
+  lcall_del(c);
+  lval_del(a);
+  return x;
 }
 
-void lenv_add_builtins(lenv* e) {
-  /* Variable Functions */
-  lenv_add_builtin(e, "def", builtin_def);
-  
-  /* List Functions */
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
+lval* builtin_map(lenv* e, lval* a) {
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
   
-  /* Mathematical Functions */
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
-  lenv_add_builtin(e, "%", builtin_mod);
+  lval* list = a->cell[1];
+  lval* r = lval_qexpr();
+  r->cell = malloc(sizeof(lval*) * list->count);
+  lcall* c = lcall_new(e, a->cell[0]);
+  for (int i = 0; i < list->count; i++) {
+    lval* x = lcall_run(c, &list->cell[i], 1);
+    if (x->type == LVAL_ERR) {
+      lval_del(r);
+      return lval_walked(a, list, i + 1, c, x);
+    }
+    r->cell[r->count++] = x;
+  }
+  return lval_walked(a, list, list->count, c, r);
 }
 
-/* Evaluation */
-
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+lval* builtin_filter(lenv* e, lval* a) {
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
   
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
+  lval* list = a->cell[1];
+  lval* r = lval_qexpr();
+  r->cell = malloc(sizeof(lval*) * list->count);
+  lcall* c = lcall_new(e, a->cell[0]);
+  for (int i = 0; i < list->count; i++) {
+    lval* x = lval_copy(list->cell[i]);
+    x = lcall_run(c, &x, 1);
+    lval* err = lval_test(x, "filter");
+    if (err) {
+      lval_del(r);
+      return lval_walked(a, list, i, c, err);
+    }
+    if (x->num) {
+      r->cell[r->count++] = list->cell[i];
+    } else {
+      lval_del(list->cell[i]);
+    }
+    lval_del(x);
   }
-  
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+  return lval_walked(a, list, list->count, c, r);
+}
+
+/* Fold the cells of list a->cell[1] from i on into acc, with function a->cell[0] */
+lval* lval_fold(lenv* e, lval* a, lval* acc, int i) {
+  lval* list = a->cell[1];
+  lcall* c = lcall_new(e, a->cell[0]);
+  for (; i < list->count; i++) {
+    lval* args[] = { acc, list->cell[i] };
+    acc = lcall_run(c, args, 2);
+    if (acc->type == LVAL_ERR) { return lval_walked(a, list, i + 1, c, acc); }
   }
+  return lval_walked(a, list, i, c, acc);
+}
+
+lval* builtin_fold(lenv* e, lval* a) {
+  LASSERT_NUM("fold", a, 3);
+  LASSERT_TYPE("fold", a, 0, LVAL_FUN);
+  LASSERT_TYPE("fold", a, 2, LVAL_QEXPR);
   
-  if (v->count == 0) { return v; }  
-  if (v->count == 1) { return lval_take(v, 0); }
-  
-  /* Ensure first element is a function after evaluation */
-  lval* f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN) {
-    lval* err = lval_err(
-      "S-Expression starts with incorrect type. "
-      "Got %s, Expected %s.",
-      ltype_name(f->type), ltype_name(LVAL_FUN));
-    lval_del(f); lval_del(v);
-    return err;
-  }
+  lval* acc = lval_pop(a, 1);
+  return lval_fold(e, a, acc, 0);
+}
+
+lval* builtin_reduce(lenv* e, lval* a) {
+  LASSERT_NUM("reduce", a, 2);
+  LASSERT_TYPE("reduce", a, 0, LVAL_FUN);
+  LASSERT_TYPE("reduce", a, 1, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("reduce", a, 1);
   
-  /* If so call function to get result */
-  lval* result = f->builtin(e, v);
-  lval_del(f);
-  return result;
+  return lval_fold(e, a, a->cell[1]->cell[0], 1);
 }
 
-lval* lval_eval(lenv* e, lval* v) {
-  if (v->type == LVAL_SYM) {
-    lval* x = lenv_get(e, v);
-    lval_del(v);
-    return x;
-  }
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+lval* builtin_take(lenv* e, lval* a) {
+  LASSERT_NUM("take", a, 2);
+  LASSERT_TYPE("take", a, 0, LVAL_NUM);
+  LASSERT_TYPE("take", a, 1, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->num >= 0,
+    "Function 'take' passed negative count %li.", a->cell[0]->num);
+  
+  long n = a->cell[0]->num;
+  lval* v = lval_take(a, 1);
+  while (v->count > n) { lval_del(v->cell[--v->count]); }
   return v;
 }
 
-/* Reading */
+/*
+ * Fused list pipelines. The simplifier turns a chain of list functions
+ * each given the result of the next, such as
+ *
+ *   (fold + 0 (map f (filter p xs)))
+ *
+ * into a call to builtin_pipe, with the stages named outermost first,
+ * followed by their arguments in the order they were written:
+ *
+ *   (<builtin> {fold map filter} + 0 f p xs)
+ *
+ * If every function is pure the stages run together on one element at
+ * a time, building no list between them. Otherwise, or if anything
+ * goes wrong, the stages run one after the other as the calls would
+ * have, which for pure functions gives the same value or first error.
+ * Elements a take has no room for still go through the stages before
+ * it, in case they give an error.
+ */
 
-lval* lval_read_num(mpc_ast_t* t) {
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("Invalid Number.");
+typedef struct {
+  char* name;
+  lbuiltin fn;
+  int args;
+  int list;
+} lstage;
+
+/* name, builtin, arguments before the list, gives a list */
+lstage lstages[] = {
+  { "map", builtin_map, 1, 1 }, { "filter", builtin_filter, 1, 1 },
+  { "take", builtin_take, 1, 1 }, { "fold", builtin_fold, 2, 0 },
+  { "reduce", builtin_reduce, 1, 0 }, { NULL, NULL, 0, 0 }
+};
+
+lstage* lstage_of(lbuiltin f) {
+  for (lstage* s = lstages; f && s->name; s++) {
+    if (s->fn == f) { return s; }
+  }
+  return NULL;
+}
+
+lstage* lstage_named(char* name) {
+  for (lstage* s = lstages; s->name; s++) {
+    if (strcmp(s->name, name) == 0) { return s; }
+  }
+  return NULL;
+}
+
+int lval_is_pure(lbuiltin f);
+
+/* Can resolved code x only call pure builtins */
+int lval_pure_code(lval* x) {
+  if (x->type != LVAL_SEXPR) { return 1; }
+  if (x->count > 1) {
+    lval* h = x->cell[0];
+    if (h->type == LVAL_FUN && h->builtin == builtin_ref) { h = x->cell[1]->cell[0]; }
+    h = h->type == LVAL_SYM ? h->global : NULL;
+    if (!h || h->type != LVAL_FUN || !h->builtin || !lval_is_pure(h->builtin)) {
+      return 0;
+    }
+  }
+  for (int i = 0; i < x->count; i++) {
+    if (!lval_pure_code(x->cell[i])) { return 0; }
+  }
+  return 1;
+}
+
+lval* lchunk_body(struct lchunk* c);
+void lsimp_refresh(lval* f);
+
+int lval_pure_fn(lval* f) {
+  if (f->type != LVAL_FUN) { return 0; }
+  if (f->builtin) { return lval_is_pure(f->builtin); }
+  lsimp_refresh(f);
+  return lval_pure_code(lchunk_body(f->chunk));
+}
+
+/* Run the stages of pipeline a one after the other, consuming it */
+lval* lpipe_unfused(lenv* e, lval* a) {
+  lval* stages = a->cell[0];
+  int n = stages->count;
+  int* at = malloc(sizeof(int) * (n + 1));
+  at[0] = 1;
+  for (int k = 0; k < n; k++) {
+    at[k+1] = at[k] + lstage_named(stages->cell[k]->sym)->args;
+  }
+  
+  lval* x = a->cell[at[n]];
+  a->cell[at[n]] = lval_sexpr();
+  for (int k = n - 1; k >= 0 && x->type != LVAL_ERR; k--) {
+    lstage* s = lstage_named(stages->cell[k]->sym);
+    lval* call = lval_sexpr();
+    for (int j = 0; j < s->args; j++) {
+      call = lval_add(call, lval_copy(a->cell[at[k]+j]));
+    }
+    x = s->fn(e, lval_add(call, x));
+  }
+  free(at);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_pipe(lenv* e, lval* a) {
+  lval* stages = a->cell[0];
+  int n = stages->count;
+  lval** args = a->cell + 1;
+  lval* src = a->cell[a->count-1];
+  if (src->type != LVAL_QEXPR) { return lpipe_unfused(e, a); }
+  
+  /* Check each stage gets what it needs, with pure functions */
+  lstage** st = malloc(sizeof(lstage*) * n);
+  lval*** in = malloc(sizeof(lval**) * n);
+  lcall** calls = calloc(n, sizeof(lcall*));
+  long* left = calloc(n, sizeof(long));
+  int ok = 1;
+  for (int k = 0; k < n; k++) {
+    st[k] = lstage_named(stages->cell[k]->sym);
+    in[k] = args;
+    args += st[k]->args;
+    if (st[k]->fn == builtin_take) {
+      ok &= in[k][0]->type == LVAL_NUM && in[k][0]->num >= 0;
+      left[k] = in[k][0]->num;
+    } else {
+      ok &= lval_pure_fn(in[k][0]);
+    }
+  }
+  
+  /* Elements past a take with only takes before it are never looked at */
+  int last = src->count;
+  
+  lval* r = NULL;
+  int any = 0;
+  if (ok && st[0]->list) {
+    r = lval_qexpr();
+    r->cell = malloc(sizeof(lval*) * src->count);
+  }
+  if (ok && st[0]->fn == builtin_fold) { r = lval_copy(in[0][1]); any = 1; }
+  if (ok) {
+    for (int k = 0; k < n; k++) {
+      if (st[k]->fn != builtin_take) { calls[k] = lcall_new(e, in[k][0]); }
+    }
+  }
+  
+  for (int i = 0; ok && i < last; i++) {
+    lval* x = lval_copy(src->cell[i]);
+    for (int k = n - 1; x && k >= 0; k--) {
+      lbuiltin f = st[k]->fn;
+      if (f == builtin_map) {
+        x = lcall_run(calls[k], &x, 1);
+        if (x->type == LVAL_ERR) { ok = 0; }
+      } else if (f == builtin_filter) {
+        lval* t = lcall_run(calls[k], (lval*[]){ lval_copy(x) }, 1);
+        lval* err = lval_test(t, "filter");
+        if (err) { ok = 0; lval_del(err); break; }
+        if (!t->num) { lval_del(x); x = NULL; }
+        lval_del(t);
+      } else if (f == builtin_take) {
+        if (left[k] == 0) {
+          lval_del(x);
+          x = NULL;
+          int rest = 1;
+          for (int j = k + 1; j < n; j++) { rest &= st[j]->fn == builtin_take; }
+          if (rest) { last = i; }
+        } else {
+          left[k]--;
+        }
+      } else if (!any) {
+        r = x;
+        x = NULL;
+        any = 1;
+      } else {
+        r = lcall_run(calls[k], (lval*[]){ r, x }, 2);
+        x = NULL;
+        if (r->type == LVAL_ERR) { ok = 0; }
+      }
+      if (!ok) { break; }
+    }
+    if (x && ok) { r->cell[r->count++] = x; } else if (x) { lval_del(x); }
+  }
+  
+  for (int k = 0; k < n; k++) { if (calls[k]) { lcall_del(calls[k]); } }
+  free(st);
+  free(in);
+  free(calls);
+  free(left);
+  if (!ok || (!any && !r)) {
+    if (r) { lval_del(r); }
+    return lpipe_unfused(e, a);
+  }
+  lval_del(a);
+  return r;
+}
+
+/*
+ * Fixnum arithmetic. Each operator is a step folding one more operand
+ * into x, returning LARITH_OK or the reason it could not.
+ */
+
+enum { LARITH_OK, LARITH_OVERFLOW, LARITH_DIV_ZERO, LARITH_UNTYPED };
+
+int larith_add(long* x, long y) {
+  return __builtin_add_overflow(*x, y, x) ? LARITH_OVERFLOW : LARITH_OK;
+}
+
+int larith_sub(long* x, long y) {
+  return __builtin_sub_overflow(*x, y, x) ? LARITH_OVERFLOW : LARITH_OK;
+}
+
+int larith_mul(long* x, long y) {
+  return __builtin_mul_overflow(*x, y, x) ? LARITH_OVERFLOW : LARITH_OK;
+}
+
+int larith_div(long* x, long y) {
+  if (y == 0) { return LARITH_DIV_ZERO; }
+  if (*x == LONG_MIN && y == -1) { return LARITH_OVERFLOW; }
+  *x /= y;
+  return LARITH_OK;
+}
+
+/* Truncating, so the result takes the sign of x */
+int larith_mod(long* x, long y) {
+  if (y == 0) { return LARITH_DIV_ZERO; }
+  *x = y == -1 ? 0 : *x % y;
+  return LARITH_OK;
+}
+
+lval* larith_err(int status) {
+  if (status == LARITH_DIV_ZERO) { return lval_err("Division By Zero."); }
+  return lval_err("Integer Overflow.");
+}
+
+/* name, symbol */
+#define LARITH_OPS(X) \
+  X(add, "+") X(sub, "-") X(mul, "*") X(div, "/") X(mod, "%")
+
+/*
+ * For each operator, an n-ary kernel over numbers which have already
+ * been type checked, and the builtin wrapping it. Only '-' does
+ * anything with a single operand.
+ */
+#define LARITH_KERNEL(name, op) \
+  int larith_##name##_n(long* x, lval** args, int n) { \
+    *x = args[0]->num; \
+    if (n == 2) { return larith_##name(x, args[1]->num); } \
+    if (n == 1 && larith_##name == larith_sub) { \
+      *x = 0; \
+      return larith_sub(x, args[0]->num); \
+    } \
+    int status = LARITH_OK; \
+    for (int i = 1; i < n && status == LARITH_OK; i++) { \
+      status = larith_##name(x, args[i]->num); \
+    } \
+    return status; \
+  } \
+  \
+  lval* builtin_##name(lenv* e, lval* a) { \
+    LASSERT(a, a->count > 0, "Function '%s' passed no arguments.", op); \
+    for (int i = 0; i < a->count; i++) { \
+      LASSERT_TYPE(op, a, i, LVAL_NUM); \
+    } \
+    long x; \
+    int status = larith_##name##_n(&x, a->cell, a->count); \
+    if (status != LARITH_OK) { lval_del(a); return larith_err(status); } \
+    \
+    /* Reuse the first operand for the result */ \
+    lval* r = a->cell[0]; \
+    a->cell[0] = a->cell[--a->count]; \
+    lval_del(a); \
+    r->num = x; \
+    return r; \
+  }
+
+LARITH_OPS(LARITH_KERNEL)
+
+typedef int (*larith_step_fn)(long*, long);
+
+/*
+ * Comparisons give 1 or 0, and always take two operands. Their steps
+ * replace x with the comparison of it and y, so typed expressions can
+ * compute them like arithmetic.
+ */
+
+/* name, symbol, C operator */
+#define LCMP_OPS(X) \
+  X(lt, "<", <) X(gt, ">", >) X(le, "<=", <=) X(ge, ">=", >=) \
+  X(eq, "==", ==) X(ne, "!=", !=)
+
+#define LCMP_STEP(name, op, c) \
+  int larith_##name(long* x, long y) { *x = *x c y; return LARITH_OK; }
+
+LCMP_OPS(LCMP_STEP)
+
+int lval_is_compare(lbuiltin f) {
+  #define LCMP_IS(name, op, c) if (f == builtin_##name) { return 1; }
+  LCMP_OPS(LCMP_IS)
+  #undef LCMP_IS
+  return 0;
+}
+
+/*
+ * Order x and y into *c, below, at or above 0 as for strcmp: numbers by
+ * value, symbols as strings, and lists element by element, a list that
+ * another starts with coming first. NULL if they can be ordered, or the
+ * error op gives otherwise.
+ */
+lval* lval_order(lval* x, lval* y, char* op, int* c) {
+  int t = x->type;
+  if (t != LVAL_NUM && t != LVAL_SYM && t != LVAL_QEXPR) {
+    return lval_err("Function '%s' cannot order %s.", op, ltype_name(t));
+  }
+  if (y->type != t) {
+    return lval_err("Function '%s' cannot order %s with %s.",
+      op, ltype_name(t), ltype_name(y->type));
+  }
+  
+  if (t == LVAL_NUM) { *c = (x->num > y->num) - (x->num < y->num); return NULL; }
+  if (t == LVAL_SYM) { *c = strcmp(x->sym, y->sym); return NULL; }
+  for (int i = 0; i < x->count && i < y->count; i++) {
+    lval* err = lval_order(x->cell[i], y->cell[i], op, c);
+    if (err || *c) { return err; }
+  }
+  *c = (x->count > y->count) - (x->count < y->count);
+  return NULL;
+}
+
+lval* builtin_ord(lenv* e, lval* a, char* op, larith_step_fn step) {
+  LASSERT_NUM(op, a, 2);
+  
+  if (a->cell[0]->type == LVAL_NUM && a->cell[1]->type == LVAL_NUM) {
+    long y = a->cell[1]->num;
+    lval* r = lval_take(a, 0);
+    step(&r->num, y);
+    return r;
+  }
+  
+  int c;
+  lval* err = lval_order(a->cell[0], a->cell[1], op, &c);
+  lval_del(a);
+  if (err) { return err; }
+  long r = c;
+  step(&r, 0);
+  return lval_num(r);
+}
+
+lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, "<", larith_lt); }
+lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, ">", larith_gt); }
+lval* builtin_le(lenv* e, lval* a) { return builtin_ord(e, a, "<=", larith_le); }
+lval* builtin_ge(lenv* e, lval* a) { return builtin_ord(e, a, ">=", larith_ge); }
+
+unsigned long lhash_mix(unsigned long h, unsigned long x) {
+  h = (h ^ x) * 0x9e3779b97f4a7c15UL;
+  return h ^ (h >> 29);
+}
+
+unsigned long lhash_str(unsigned long h, char* s) {
+  for (; *s; s++) { h = (h ^ (unsigned char)*s) * 0x100000001b3UL; }
+  return h;
+}
+
+/* Hash of the bindings a closure environment e has, up to the global one */
+unsigned long lenv_hash(lenv* e) {
+  unsigned long h = 0;
+  for (; e->par; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      h = lhash_mix(lhash_str(h, e->syms[i]), lval_hash(e->vals[i]));
+    }
+  }
+  return h;
+}
+
+/*
+ * Structural hash, the same for any values lval_eq finds equal. A list
+ * keeps its hash once computed, which is only done to lists that do not
+ * change afterwards: values where they are bound, and arguments. Copies
+ * start without one.
+ */
+unsigned long lval_hash(lval* x) {
+  switch (x->type) {
+    case LVAL_NUM: return lhash_mix(LVAL_NUM, x->num);
+    case LVAL_ERR: return lhash_str(LVAL_ERR, x->err);
+    case LVAL_SYM: return lhash_str(LVAL_SYM, x->sym);
+    case LVAL_FUN:
+      if (x->builtin) { return lhash_mix(LVAL_FUN, (unsigned long)(size_t)x->builtin); }
+      return lhash_mix(lhash_mix(lval_hash(x->formals), lval_hash(x->body)),
+        lenv_hash(x->env));
+  }
+  
+  if (!x->hash) {
+    unsigned long h = x->type;
+    for (int i = 0; i < x->count; i++) { h = lhash_mix(h, lval_hash(x->cell[i])); }
+    x->hash = h ? h : 1;
+  }
+  return x->hash;
+}
+
+lval* builtin_hash(lenv* e, lval* a) {
+  LASSERT_NUM("hash", a, 1);
+  
+  lval* x = lval_num((long)(lval_hash(a->cell[0]) >> 1));
+  lval_del(a);
+  return x;
+}
+
+/* Whether closure environments x and y bind equal values, up to the global one */
+int lenv_eq(lenv* x, lenv* y) {
+  for (; x != y; x = x->par, y = y->par) {
+    if (!x->par || !y->par || x->count != y->count) { return 0; }
+    for (int i = 0; i < x->count; i++) {
+      if (strcmp(x->syms[i], y->syms[i]) != 0) { return 0; }
+      if (!lval_eq(x->vals[i], y->vals[i])) { return 0; }
+    }
+  }
+  return 1;
+}
+
+/*
+ * Structural equality. Lambdas are equal if written the same way and
+ * closed over equal values. Lists are unequal without looking inside if
+ * both hashes are known to differ.
+ */
+int lval_eq(lval* x, lval* y) {
+  if (x == y) { return 1; }
+  if (x->type != y->type) { return 0; }
+  
+  switch (x->type) {
+    case LVAL_NUM: return x->num == y->num;
+    case LVAL_ERR: return strcmp(x->err, y->err) == 0;
+    case LVAL_SYM: return strcmp(x->sym, y->sym) == 0;
+    case LVAL_FUN:
+      if (x->builtin || y->builtin) { return x->builtin == y->builtin; }
+      return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body)
+        && lenv_eq(x->env, y->env);
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      if (x->count != y->count) { return 0; }
+      if (x->hash && y->hash && x->hash != y->hash) { return 0; }
+      for (int i = 0; i < x->count; i++) {
+        if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
+      }
+      return 1;
+  }
+  return 0;
+}
+
+lval* builtin_cmp(lenv* e, lval* a, char* op) {
+  LASSERT_NUM(op, a, 2);
+  int r = lval_eq(a->cell[0], a->cell[1]);
+  if (strcmp(op, "!=") == 0) { r = !r; }
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(e, a, "=="); }
+lval* builtin_ne(lenv* e, lval* a) { return builtin_cmp(e, a, "!="); }
+
+/* The step of arithmetic or comparison builtin f, or NULL if it is neither */
+larith_step_fn larith_step(lbuiltin f) {
+  #define LARITH_STEP(name, op) if (f == builtin_##name) { return larith_##name; }
+  #define LCMP_STEP_OF(name, op, c) if (f == builtin_##name) { return larith_##name; }
+  LARITH_OPS(LARITH_STEP)
+  LCMP_OPS(LCMP_STEP_OF)
+  #undef LARITH_STEP
+  #undef LCMP_STEP_OF
+  return NULL;
+}
+
+/*
+ * Compute x, typed as arithmetic by lval_infer, in environment e without
+ * boxing any number on the way. The symbols in it are the only things
+ * checked, along with the builtin still being bound. If it returns
+ * anything but LARITH_OK, evaluating x as usual gives the right error.
+ */
+int larith_eval(lenv* e, lval* x, long* out) {
+  if (x->type == LVAL_NUM) { *out = x->num; return LARITH_OK; }
+  if (x->type == LVAL_SYM) {
+    lval* v = lenv_peek(e, x);
+    if (!v || v->type != LVAL_NUM) { return LARITH_UNTYPED; }
+    *out = v->num;
+    return LARITH_OK;
+  }
+  
+  lval* f = x->cell[0]->global;
+  if (f->type != LVAL_FUN || f->builtin != x->builtin) { return LARITH_UNTYPED; }
+  
+  /*
+   * Anything can be tested for equality, so two names bound to other
+   * than numbers are compared where they are bound, rather than copied
+   * out first. Lists are hashed there, so that comparing them again is
+   * quick if they differ.
+   */
+  if ((x->builtin == builtin_eq || x->builtin == builtin_ne)
+      && x->cell[1]->type == LVAL_SYM && x->cell[2]->type == LVAL_SYM) {
+    lval* a = lenv_peek(e, x->cell[1]);
+    lval* b = lenv_peek(e, x->cell[2]);
+    if (a && b && (a->type != LVAL_NUM || b->type != LVAL_NUM)) {
+      if (a->type == LVAL_QEXPR && b->type == LVAL_QEXPR) {
+        lval_hash(a);
+        lval_hash(b);
+      }
+      *out = lval_eq(a, b) == (x->builtin == builtin_eq);
+      return LARITH_OK;
+    }
+  }
+  
+  if (x->builtin == builtin_if) {
+    long c;
+    int status = larith_eval(e, x->cell[1], &c);
+    return status == LARITH_OK ? larith_eval(e, x->cell[c ? 2 : 3], out) : status;
+  }
+  
+  int status = larith_eval(e, x->cell[1], out);
+  if (x->count == 2 && x->builtin == builtin_sub && status == LARITH_OK) {
+    long y = *out;
+    *out = 0;
+    return larith_sub(out, y);
+  }
+  larith_step_fn step = larith_step(x->builtin);
+  for (int i = 2; i < x->count && status == LARITH_OK; i++) {
+    long y;
+    status = larith_eval(e, x->cell[i], &y);
+    if (status == LARITH_OK) { status = step(out, y); }
+  }
+  return status;
+}
+
+/*
+ * Conditionals. Each call the simplifier can tell is to one of these
+ * becomes a special form, which evaluates only what it needs to. Called
+ * any other way, as builtins, their arguments are already evaluated.
+ * Anything but 0 is true, and a condition must be a number.
+ */
+
+int lval_is_cond(lbuiltin f) {
+  return f == builtin_if || f == builtin_cond || f == builtin_and || f == builtin_or;
+}
+
+int lval_is_loop(lbuiltin f);
+
+int lval_is_form(lbuiltin f) { return lval_is_cond(f) || lval_is_loop(f); }
+
+char* lform_name(lbuiltin f) {
+  if (f == builtin_if) { return "if"; }
+  if (f == builtin_cond) { return "cond"; }
+  if (f == builtin_and) { return "and"; }
+  if (f == builtin_or) { return "or"; }
+  if (f == builtin_while) { return "while"; }
+  if (f == builtin_dotimes) { return "dotimes"; }
+  return "for-each";
+}
+
+/*
+ * NULL if condition x of a form is a number, otherwise the error which
+ * the form gives instead, which takes ownership of x.
+ */
+lval* lval_test(lval* x, char* form) {
+  if (x->type == LVAL_NUM) { return NULL; }
+  if (x->type == LVAL_ERR) { return x; }
+  lval* err = lval_err(
+    "Function '%s' passed incorrect type for condition. Got %s, Expected %s.",
+    form, ltype_name(x->type), ltype_name(LVAL_NUM));
+  lval_del(x);
+  return err;
+}
+
+/* Value of branch x taken by if or cond, run if it is a Q-Expression */
+lval* lval_branch(lenv* e, lval* x) {
+  if (x->type != LVAL_QEXPR) { return x; }
+  x->type = LVAL_SEXPR;
+  return lval_run(e, x);
+}
+
+lval* builtin_if(lenv* e, lval* a) {
+  LASSERT_NUM("if", a, 3);
+  
+  lval* c = lval_pop(a, 0);
+  lval* err = lval_test(c, "if");
+  if (err) { lval_del(a); return err; }
+  
+  int i = c->num ? 0 : 1;
+  lval_del(c);
+  return lval_branch(e, lval_take(a, i));
+}
+
+/* Pairs of a condition and a branch, then an optional last branch */
+lval* builtin_cond(lenv* e, lval* a) {
+  while (a->count > 1) {
+    lval* c = lval_pop(a, 0);
+    lval* err = lval_test(c, "cond");
+    if (err) { lval_del(a); return err; }
+    
+    int taken = c->num != 0;
+    lval_del(c);
+    if (taken) { return lval_branch(e, lval_take(a, 0)); }
+    lval_del(lval_pop(a, 0));
+  }
+  
+  if (a->count) { return lval_branch(e, lval_take(a, 0)); }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* The first operand whose truth is stop, or else the last operand */
+lval* builtin_logic(lenv* e, lval* a, char* op, int stop) {
+  LASSERT(a, a->count > 0, "Function '%s' passed no arguments.", op);
+  
+  while (a->count > 1) {
+    lval* x = lval_pop(a, 0);
+    lval* err = lval_test(x, op);
+    if (err) { lval_del(a); return err; }
+    if ((x->num != 0) == stop) { lval_del(a); return x; }
+    lval_del(x);
+  }
+  return lval_take(a, 0);
+}
+
+lval* builtin_and(lenv* e, lval* a) { return builtin_logic(e, a, "and", 0); }
+lval* builtin_or(lenv* e, lval* a) { return builtin_logic(e, a, "or", 1); }
+
+/*
+ * Loops, which give () or the first error in them. As special forms
+ * they run their cells in place. Called as builtins the condition and
+ * bodies have to be Q-Expressions, run afresh each time round.
+ */
+
+int lval_is_loop(lbuiltin f) {
+  return f == builtin_while || f == builtin_dotimes || f == builtin_for_each;
+}
+
+/* NULL if x is the right type of source for loop form, or the error if not */
+lval* lval_source(lval* x, lbuiltin form) {
+  int expect = form == builtin_dotimes ? LVAL_NUM : LVAL_QEXPR;
+  if (x->type == expect) { return NULL; }
+  if (x->type == LVAL_ERR) { return lval_copy(x); }
+  return lval_err(
+    "Function '%s' passed incorrect type for argument 1. Got %s, Expected %s.",
+    lform_name(form), ltype_name(x->type), ltype_name(expect));
+}
+
+/* Run the bodies in cells first onwards of a, stopping at an error */
+lval* lval_bodies(lenv* e, lval* a, int first) {
+  for (int i = first; i < a->count; i++) {
+    lval* x = lval_copy(a->cell[i]);
+    x->type = LVAL_SEXPR;
+    x = lval_run(e, x);
+    if (x->type == LVAL_ERR) { return x; }
+    lval_del(x);
+  }
+  return NULL;
+}
+
+lval* builtin_while(lenv* e, lval* a) {
+  LASSERT(a, a->count > 0, "Function 'while' passed no arguments.");
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("while", a, i, LVAL_QEXPR);
+  }
+  
+  for (;;) {
+    lval* c = lval_copy(a->cell[0]);
+    c->type = LVAL_SEXPR;
+    c = lval_run(e, c);
+    lval* err = lval_test(c, "while");
+    if (err) { lval_del(a); return err; }
+    
+    int taken = c->num != 0;
+    lval_del(c);
+    if (!taken) { break; }
+    if ((err = lval_bodies(e, a, 1))) { lval_del(a); return err; }
+  }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* dotimes and for-each, with the variable, the source and the bodies */
+lval* builtin_loop(lenv* e, lval* a, lbuiltin form) {
+  char* name = lform_name(form);
+  LASSERT(a, a->count >= 2,
+    "Function '%s' passed too few arguments. Got %i, Expected at least 2.",
+    name, a->count);
+  LASSERT_TYPE(name, a, 0, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+    "Function '%s' passed invalid variable. Expected a single symbol.", name);
+  for (int i = 2; i < a->count; i++) {
+    LASSERT_TYPE(name, a, i, LVAL_QEXPR);
+  }
+  lval* err = lval_source(a->cell[1], form);
+  if (err) { lval_del(a); return err; }
+  
+  lval* src = a->cell[1];
+  lenv* l = lenv_loop(e, a->cell[0]->cell[0]);
+  long n = 0;
+  while (!err && lenv_iterate(l, src, n)) {
+    n++;
+    err = lval_bodies(l, a, 2);
+  }
+  lenv_unloop(l, src, n);
+  lval_del(a);
+  return err ? err : lval_sexpr();
+}
+
+lval* builtin_dotimes(lenv* e, lval* a) { return builtin_loop(e, a, builtin_dotimes); }
+lval* builtin_for_each(lenv* e, lval* a) { return builtin_loop(e, a, builtin_for_each); }
+
+struct lchunk* lval_compile_body(lenv* e, lval* formals, lval* body);
+lval* lchunk_body(struct lchunk* c);
+
+/* A lambda running in environment e, which it takes ownership of */
+lval* lval_closure(lenv* e, lval* formals, lval* body) {
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_FUN;
+
+    // Set Builtin to NULL
+    v->builtin = NULL;
+
+    v->env = e;
+
+    // Set Formals and body, kept by the chunk
+    v->formals = formals;
+    v->body = body;
+
+    // Simplify and compile the body once, for every copy to share
+    v->chunk = lval_compile_body(v->env, formals, body);
+    return v;
+}
+
+lval* lval_lambda(lenv* e, lval* formals, lval* body) {
+  // Capture the locals it uses from the environment it was made in
+  return lval_closure(lenv_capture(e, formals, body), formals, body);
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+  LASSERT_NUM("\\", a, 2);
+  LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+  
+  /* Check first Q-Expression contains only Symbols */
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+      "Cannot define non-symbol. Got %s, Expected %s.",
+      ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+  
+  lval* formals = lval_pop(a, 0);
+  lval* body = lval_pop(a, 0);
+  lval_del(a);
+  
+  return lval_lambda(e, formals, body);
+}
+
+lval* builtin_def(lenv* e, lval* a) {
+
+  LASSERT_TYPE("def", a, 0, LVAL_QEXPR);
+  
+  /* First argument is symbol list */
+  lval* syms = a->cell[0];
+  
+  /* Ensure all elements of first list are symbols */
+  for (int i = 0; i < syms->count; i++) {
+    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+      "Function 'def' cannot define non-symbol. "
+      "Got %s, Expected %s.",
+      ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+  
+  /* Check correct number of symbols and values */
+  LASSERT(a, (syms->count == a->count-1),
+    "Function 'def' passed too many arguments for symbols. "
+    "Got %i, Expected %i.",
+    syms->count, a->count-1);
+  
+  /* Assign copies of values to symbols */
+  for (int i = 0; i < syms->count; i++) {
+    lenv_def(e, syms->cell[i], a->cell[i+1]);
+  }
+  
+  lval_del(a);
+  return lval_sexpr();
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_fun(func);
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
+}
+
+void lenv_add_builtins(lenv* e) {
+  /* Variable Functions */
+  lenv_add_builtin(e, "\\", builtin_lambda);
+  lenv_add_builtin(e, "def", builtin_def);
+  
+  /* List Functions */
+  lenv_add_builtin(e, "list", builtin_list);
+  lenv_add_builtin(e, "head", builtin_head);
+  lenv_add_builtin(e, "tail", builtin_tail);
+  lenv_add_builtin(e, "eval", builtin_eval);
+  lenv_add_builtin(e, "join", builtin_join);
+  lenv_add_builtin(e, "len", builtin_len);
+  lenv_add_builtin(e, "nth", builtin_nth);
+  lenv_add_builtin(e, "last", builtin_last);
+  lenv_add_builtin(e, "slice", builtin_slice);
+  lenv_add_builtin(e, "sort", builtin_sort);
+  lenv_add_builtin(e, "sort-by", builtin_sort_by);
+  lenv_add_builtin(e, "uniq", builtin_uniq);
+  lenv_add_builtin(e, "bsearch", builtin_bsearch);
+  lenv_add_builtin(e, "map", builtin_map);
+  lenv_add_builtin(e, "filter", builtin_filter);
+  lenv_add_builtin(e, "fold", builtin_fold);
+  lenv_add_builtin(e, "reduce", builtin_reduce);
+  lenv_add_builtin(e, "take", builtin_take);
+  
+  /* Mathematical Functions */
+  lenv_add_builtin(e, "+", builtin_add);
+  lenv_add_builtin(e, "-", builtin_sub);
+  lenv_add_builtin(e, "*", builtin_mul);
+  lenv_add_builtin(e, "/", builtin_div);
+  lenv_add_builtin(e, "%", builtin_mod);
+  
+  /* Comparison Functions */
+  lenv_add_builtin(e, "<", builtin_lt);
+  lenv_add_builtin(e, ">", builtin_gt);
+  lenv_add_builtin(e, "<=", builtin_le);
+  lenv_add_builtin(e, ">=", builtin_ge);
+  lenv_add_builtin(e, "==", builtin_eq);
+  lenv_add_builtin(e, "!=", builtin_ne);
+  lenv_add_builtin(e, "hash", builtin_hash);
+  
+  /* Memoization */
+  lenv_add_builtin(e, "memo", builtin_memo);
+  lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+  
+  /* Conditional Functions */
+  lenv_add_builtin(e, "if", builtin_if);
+  lenv_add_builtin(e, "cond", builtin_cond);
+  lenv_add_builtin(e, "and", builtin_and);
+  lenv_add_builtin(e, "or", builtin_or);
+  
+  /* Loops */
+  lenv_add_builtin(e, "while", builtin_while);
+  lenv_add_builtin(e, "dotimes", builtin_dotimes);
+  lenv_add_builtin(e, "for-each", builtin_for_each);
+}
+
+/* Evaluation */
+
+/* Is x the '&' in formals, before the symbol taking any more arguments */
+int lval_is_rest(lval* x) {
+  return strcmp(x->sym, "&") == 0;
+}
+
+/* Index of the '&' in formals, or -1 */
+int lval_rest(lval* formals) {
+  for (int i = 0; i < formals->count; i++) {
+    if (lval_is_rest(formals->cell[i])) { return i; }
+  }
+  return -1;
+}
+
+/*
+ * Can a frame left by a tail call be reused for a call to these formals.
+ * A frame has a slot for each formal but the '&'.
+ */
+int lenv_fits(lenv* frame, lval* formals) {
+  int j = 0;
+  for (int i = 0; i < formals->count; i++) {
+    if (lval_is_rest(formals->cell[i])) { continue; }
+    if (j == frame->count || strcmp(frame->syms[j], formals->cell[i]->sym) != 0) {
+      return 0;
+    }
+    j++;
+  }
+  return j == frame->count;
+}
+
+/* Put x in slot i of a call frame, named by formal k */
+void lenv_slot(lenv* frame, int i, lval* k, lval* x) {
+  if (i < frame->count) {
+    /* Reused frame, just swap the values */
+    lval_del(frame->vals[i]);
+    frame->vals[i] = x;
+    return;
+  }
+  lenv_grow(frame);
+  frame->syms[i] = k->sym;
+  frame->vals[i] = x;
+  frame->count++;
+  frame->borrowed++;
+}
+
+/* Lambda f with its first n formals bound to args, taking ownership of them */
+lval* lval_partial(lval* f, lval** args, int n) {
+  lenv* e = lenv_new();
+  e->par = lenv_retain(f->env);
+  lval* formals = lval_copy(f->formals);
+  for (int i = 0; i < n; i++) {
+    lval* k = lval_pop(formals, 0);
+    lenv_put(e, k, args[i]);
+    lval_del(k);
+    lval_del(args[i]);
+  }
+  return lval_closure(e, formals, lval_copy(f->body));
+}
+
+/*
+ * Bind n arguments to the formals of lambda f in a call frame, taking
+ * ownership of them. Any more than the formals before an '&' go in a
+ * Q-Expression bound to the symbol after it, and too few give a lambda
+ * taking the rest. Returns an error or that lambda, or NULL if the
+ * arguments were bound and the body should run.
+ */
+lval* lval_bind(lenv* frame, lval* f, lval** args, int n) {
+  
+  lval* formals = f->formals;
+  int rest = lval_rest(formals);
+  int total = rest < 0 ? formals->count : rest;
+  
+  if (rest >= 0 && rest != formals->count - 2) {
+    for (int i = 0; i < n; i++) { lval_del(args[i]); }
+    return lval_err("Function format invalid. "
+      "Symbol '&' not followed by single symbol.");
+  }
+  if (n > total && rest < 0) {
+    for (int i = 0; i < n; i++) { lval_del(args[i]); }
+    return lval_err(
+      "Function passed too many arguments. Got %i, Expected %i.", n, total);
+  }
+  if (n < total) { return lval_partial(f, args, n); }
+  
+  for (int i = 0; i < total; i++) {
+    lenv_slot(frame, i, formals->cell[i], args[i]);
+  }
+  if (rest >= 0) {
+    lval* x = lval_qexpr();
+    for (int i = total; i < n; i++) { lval_add(x, args[i]); }
+    lenv_slot(frame, total, formals->cell[rest+1], x);
+  }
+  return NULL;
+}
+
+void lsimp_refresh(lval* f);
+
+/*
+ * A frame for calling f, inside the environment f was made in. The one
+ * given is reused if it fits, unless something else has kept hold of it.
+ * Otherwise one is taken from the pool, so calls need not allocate. The
+ * body of f is brought up to date first, as it is about to run.
+ */
+lenv* lenv_frame(lenv* e, lval* f, lenv* old) {
+  lsimp_refresh(f);
+  if (old && old->refs == 1 && old->par == f->env && lenv_fits(old, f->formals)) {
+    if (old->chunk != f->chunk) {
+      lchunk_retain(f->chunk);
+      lchunk_release(old->chunk);
+      old->chunk = f->chunk;
+      
+      /* Names of the formals are borrowed from the chunk */
+      for (int i = 0, j = 0; i < f->formals->count; i++) {
+        if (!lval_is_rest(f->formals->cell[i])) { old->syms[j++] = f->formals->cell[i]->sym; }
+      }
+    }
+    return old;
+  }
+  if (old) { lenv_del(old); }
+  lenv* frame = lenv_pool_count ? lenv_pool[--lenv_pool_count] : lenv_new();
+  frame->refs = 1;
+  frame->par = lenv_retain(f->env);
+  frame->chunk = f->chunk;
+  lchunk_retain(f->chunk);
+  return frame;
+}
+
+/* Evaluation statistics, printed by --stats */
+typedef struct {
+  long steps;
+  int max_depth;
+  int vm_depth;
+  int max_vm_depth;
+  long cache_hits;
+  long cache_misses;
+  long jit_refused;
+} lstats;
+
+lstats hoagie_stats = { 0, 0, 0, 0, 0, 0, 0 };
+
+/*
+ * Calls the VM makes outside tail position, and code run or functions
+ * called by builtins like eval and fold, still recurse on the C stack.
+ * Each first checks how far below the outermost lval_run it has got,
+ * and gives an error rather than overflowing the stack. The limit
+ * leaves room under the usual 8MB stack, or 1MB on Windows, and can be
+ * set to suit another with -DHOAGIE_STACK_LIMIT.
+ */
+
+#ifndef HOAGIE_STACK_LIMIT
+#ifdef _WIN32
+#define HOAGIE_STACK_LIMIT (768 * 1024)
+#else
+#define HOAGIE_STACK_LIMIT (7 * 1024 * 1024)
+#endif
+#endif
+
+uintptr_t lstack_base = 0;
+long lstack_overflows = 0;
+
+lval* lstack_check(void) {
+  char here;
+  uintptr_t sp = (uintptr_t)&here;
+  if (!lstack_base) { lstack_base = sp; }
+  uintptr_t used = sp < lstack_base ? lstack_base - sp : sp - lstack_base;
+  if (used < HOAGIE_STACK_LIMIT) { return NULL; }
+  lstack_overflows++;
+  return lval_err("Nesting Too Deep.");
+}
+
+/*
+ * Call site caches. A symbol at the head of an S-Expression, naming a
+ * global function, keeps a copy of that function and the epoch it was
+ * taken in. Until a global is redefined, calls from there use the copy
+ * without looking it up, copying it, or freeing it afterwards. Copies
+ * replaced are kept until the outermost evaluation finishes, as calls
+ * which began with them may still be running.
+ */
+
+lval** lcache_dead = NULL;
+int lcache_ndead = 0;
+
+void lcache_retire(lval* fn) {
+  lcache_dead = realloc(lcache_dead, sizeof(lval*) * (lcache_ndead + 1));
+  lcache_dead[lcache_ndead++] = fn;
+}
+
+/* Freeing a copy can free a body, retiring more, which are freed too */
+void lcache_collect(void) {
+  for (int i = 0; i < lcache_ndead; i++) { lval_del(lcache_dead[i]); }
+  free(lcache_dead);
+  lcache_dead = NULL;
+  lcache_ndead = 0;
+}
+
+/*
+ * The function head symbol k calls in environment e, borrowed rather
+ * than copied, or NULL if it is not one. Formals need no cache, as the
+ * frame holding them is left alone while the call's arguments are
+ * evaluated.
+ */
+lval* lcache_fn(lenv* e, lval* k) {
+  if (k->slot >= 0) {
+    for (int i = 0; i < k->depth; i++) { e = e->par; }
+    lval* v = e->vals[k->slot];
+    return v->type == LVAL_FUN ? v : NULL;
+  }
+  if (!k->global) { return NULL; }
+  if (k->cached && k->epoch == lenv_epoch) {
+    hoagie_stats.cache_hits++;
+    return k->cached;
+  }
+  if (k->global->type != LVAL_FUN) { return NULL; }
+  hoagie_stats.cache_misses++;
+  if (k->cached) { lcache_retire(k->cached); }
+  k->cached = lval_copy(k->global);
+  k->epoch = lenv_epoch;
+  return k->cached;
+}
+
+/*
+ * The evaluator keeps its own stack of frames on the heap instead of
+ * recursing, one frame for each S-Expression part way through being
+ * evaluated. Nesting within one evaluation is limited only by memory,
+ * it can be stopped after any number of steps and carried on later,
+ * and calls in tail position replace their frame rather than adding
+ * one. Builtins calling functions start another evaluation, which does
+ * use the C stack, as do the VM, the reader, and the passes over code
+ * before it is run, like lval_simplify, lval_resolve and lval_copy.
+ *
+ * The values of the cells of each S-Expression go on a value stack
+ * kept alongside, rather than in a list made for each one. Only the
+ * builtins other than arithmetic take their arguments as a list, which
+ * they may keep or free, so those alone are copied off the stack into
+ * one. Calls to lambdas and arithmetic use them where they are.
+ */
+
+typedef struct {
+  lenv* env;
+  
+  /*
+   * S-Expression being evaluated, left as it is so lambda bodies can be
+   * run without copying them.
+   */
+  lval* code;
+  
+  /* Where the values of its cells start on the value stack, and how many */
+  int base;
+  int n;
+  
+  /* Code which is not part of a lambda body, and belongs to this entry */
+  lval* owned;
+  
+  /* The function in the first value came from lcache_fn */
+  int borrowed;
+  
+  /* Special form being run, and the cell of it evaluated next */
+  lbuiltin form;
+  int clause;
+  
+  /* Loop frame a loop is running its bodies in, and times round so far */
+  lenv* loop;
+  long index;
+  
+  /* Frame for calls made from this entry, reused between tail calls */
+  lenv* call;
+} lframe;
+
+typedef struct {
+  int count;
+  int size;
+  lframe* frames;
+  
+  /* Values of the cells evaluated by every frame, each above the last */
+  lval** vals;
+  int vsize;
+  
+  /* Value of the frame most recently finished */
+  lval* result;
+} leval;
+
+/* Start frame f on code, with room for the values of its cells */
+void leval_start(leval* m, lframe* f, lval* code) {
+  
+  /* (x) evaluates to x, so a call inside it is still a tail call */
+  while (code->count == 1 && code->cell[0]->type == LVAL_SEXPR) {
+    code = code->cell[0];
+  }
+  f->code = code;
+  f->n = 0;
+  f->borrowed = 0;
+  f->form = NULL;
+  f->loop = NULL;
+  
+  if (f->base + code->count > m->vsize) {
+    while (f->base + code->count > m->vsize) { m->vsize = m->vsize ? m->vsize * 2 : 64; }
+    m->vals = realloc(m->vals, sizeof(lval*) * m->vsize);
+  }
+}
+
+lval* lval_simplify_expr(lenv* e, lval* v);
+
+void leval_push(leval* m, lenv* e, lval* code, lval* owned) {
+  int base = 0;
+  if (m->count) {
+    lframe* top = &m->frames[m->count-1];
+    base = top->base + top->code->count;
+  }
+  if (m->count == m->size) {
+    m->size = m->size ? m->size * 2 : 16;
+    m->frames = realloc(m->frames, sizeof(lframe) * m->size);
+  }
+  lframe* f = &m->frames[m->count++];
+  f->env = e;
+  f->base = base;
+  f->owned = owned;
+  f->call = NULL;
+  leval_start(m, f, code);
+  
+  if (m->count > hoagie_stats.max_depth) { hoagie_stats.max_depth = m->count; }
+}
+
+/* Finish the top frame, whose values are all used, with value x */
+void leval_pop(leval* m, lval* x) {
+  lframe* f = &m->frames[--m->count];
+  if (f->owned) { lval_del(f->owned); }
+  if (f->call) { lenv_del(f->call); }
+  m->result = x;
+}
+
+/* Value i of frame f, freeing the others, which can include a borrowed function */
+lval* leval_take(leval* m, lframe* f, int i) {
+  lval** v = m->vals + f->base;
+  lval* x = v[i];
+  for (int j = f->borrowed ? 1 : 0; j < f->n; j++) {
+    if (j != i) { lval_del(v[j]); }
+  }
+  if (f->borrowed && i == 0) { x = lval_copy(x); }
+  f->n = 0;
+  f->borrowed = 0;
+  return x;
+}
+
+leval* leval_alloc(void) {
+  leval* m = malloc(sizeof(leval));
+  m->count = 0;
+  m->size = 0;
+  m->frames = NULL;
+  m->vals = NULL;
+  m->vsize = 0;
+  m->result = NULL;
+  return m;
+}
+
+/* Start evaluating v, which the evaluator takes ownership of */
+leval* leval_new(lenv* e, lval* v) {
+  leval* m = leval_alloc();
+  if (v->type == LVAL_SEXPR) {
+    leval_push(m, e, v, v);
+  } else if (v->type == LVAL_SYM) {
+    m->result = lenv_get(e, v);
+    lval_del(v);
+  } else {
+    m->result = v;
+  }
+  return m;
+}
+
+/* Leave the loop frame f is running in, whose source is its first value */
+void leval_unloop(leval* m, lframe* f) {
+  f->env = lenv_unloop(f->loop, m->vals[f->base], f->index);
+  f->loop = NULL;
+}
+
+/* Abandon an evaluation, or collect the result of a finished one */
+lval* leval_del(leval* m) {
+  if (m->count && m->result) { lval_del(m->result); m->result = NULL; }
+  while (m->count) {
+    lframe* f = &m->frames[m->count-1];
+    if (f->loop) { leval_unloop(m, f); }
+    if (f->n) { lval_del(leval_take(m, f, 0)); }
+    leval_pop(m, NULL);
+  }
+  lval* x = m->result;
+  free(m->frames);
+  free(m->vals);
+  free(m);
+  return x;
+}
+
+/* Every cell of the top frame is evaluated, so apply it */
+void leval_apply(leval* m) {
+  
+  lframe* f = &m->frames[m->count-1];
+  lval** v = m->vals + f->base;
+  int n = f->n;
+  
+  for (int i = 0; i < n; i++) {
+    if (v[i]->type == LVAL_ERR) { leval_pop(m, leval_take(m, f, i)); return; }
+  }
+  
+  if (n == 0) { leval_pop(m, lval_sexpr()); return; }
+  if (n == 1) { leval_pop(m, leval_take(m, f, 0)); return; }
+  
+  /* Ensure first element is a function after evaluation */
+  lval* fn = v[0];
+  if (fn->type != LVAL_FUN) {
+    lval* err = lval_err(
+      "S-Expression starts with incorrect type. "
+      "Got %s, Expected %s.",
+      ltype_name(fn->type), ltype_name(LVAL_FUN));
+    lval_del(leval_take(m, f, 0));
+    leval_pop(m, err);
+    return;
+  }
+  
+  /* From here the function and its arguments are used up */
+  int borrowed = f->borrowed;
+  lval** args = v + 1;
+  n--;
+  f->n = 0;
+  f->borrowed = 0;
+  
+  /*
+   * Calls to eval carry on in this frame, as a tail call, once the code
+   * is simplified as eval would, which finds any special forms in it.
+   */
+  if (fn->builtin == builtin_eval && n == 1 && args[0]->type == LVAL_QEXPR) {
+    if (!borrowed) { lval_del(fn); }
+    lval* x = args[0];
+    x->type = LVAL_SEXPR;
+    x = lval_simplify_expr(f->env, x);
+    if (x->type != LVAL_SEXPR) {
+      leval_pop(m, x->type == LVAL_SYM ? lenv_get(f->env, x) : lval_copy(x));
+      lval_del(x);
+      return;
+    }
+    if (f->owned) { lval_del(f->owned); }
+    f->owned = x;
+    leval_start(m, f, x);
+    return;
+  }
+  
+  /*
+   * As do calls to lambdas, evaluating the body in the call frame. The
+   * frame keeps the chunk holding the body alive while it runs.
+   */
+  if (!fn->builtin) {
+    
+    /* A formal's value may be freed by replacing the frame it is in */
+    if (borrowed && f->code->cell[0]->slot >= 0) {
+      fn = lval_copy(fn);
+      borrowed = 0;
+    }
+    f->call = lenv_frame(f->env, fn, f->call);
+    lval* r = lval_bind(f->call, fn, args, n);
+    if (r) {
+      if (!borrowed) { lval_del(fn); }
+      leval_pop(m, r);
+      return;
+    }
+    
+    if (f->owned) { lval_del(f->owned); f->owned = NULL; }
+    f->env = f->call;
+    leval_start(m, f, lchunk_body(fn->chunk));
+    if (!borrowed) { lval_del(fn); }
+    return;
+  }
+  
+  /* Otherwise call the builtin to get result */
+  lval* result = lvm_apply(f->env, fn->builtin, args, n);
+  if (!borrowed) { lval_del(fn); }
+  leval_pop(m, result);
+}
+
+/*
+ * A special form evaluates its cells one at a time, so its frame holds
+ * at most one value, the condition just evaluated. Once it knows which
+ * cell gives its value, the frame carries on with that in place, as
+ * code in tail position.
+ */
+
+/* Carry on frame f with x, the cell of its form giving its value */
+void leval_become(leval* m, lframe* f, lval* x) {
+  if (x->type == LVAL_SEXPR) { leval_start(m, f, x); return; }
+  leval_pop(m, x->type == LVAL_SYM ? lenv_get(f->env, x) : lval_copy(x));
+}
+
+void leval_form(leval* m, lframe* f) {
+  
+  lval** v = m->vals + f->base;
+  lval* code = f->code;
+  int i = f->clause;
+  int last = code->count - 1;
+  long num = 0;
+  lval* t = NULL;
+  
+  if (f->n == 0) {
+    /* A cond with no branch taken gives () */
+    if (i > last) { leval_pop(m, lval_sexpr()); return; }
+    
+    /* The last operand of and and or, or the last branch of cond */
+    if (i == last && f->form != builtin_if) { leval_become(m, f, code->cell[i]); return; }
+    
+    /* Evaluate the condition, in a frame above unless it is typed */
+    lval* x = code->cell[i];
+    if (x->type == LVAL_SEXPR) {
+      if (!x->builtin || larith_eval(f->env, x, &num) != LARITH_OK) {
+        leval_push(m, f->env, x, NULL);
+        return;
+      }
+    } else {
+      t = x->type == LVAL_SYM ? lenv_get(f->env, x) : lval_copy(x);
+    }
+  } else {
+    t = v[0];
+    f->n = 0;
+  }
+  
+  if (t) {
+    lval* err = lval_test(t, lform_name(f->form));
+    if (err) { leval_pop(m, err); return; }
+    num = t->num;
+    lval_del(t);
+  }
+  
+  if (f->form == builtin_if) { leval_become(m, f, code->cell[num ? 2 : 3]); return; }
+  if (f->form == builtin_cond) {
+    if (num) { leval_become(m, f, code->cell[i+1]); return; }
+    f->clause += 2;
+    return;
+  }
+  
+  /* and stops at the first operand which is 0, or stops at one which is not */
+  if ((num != 0) == (f->form == builtin_or)) { leval_pop(m, lval_num(num)); return; }
+  f->clause++;
+}
+
+/*
+ * Loops evaluate their cells one at a time too, going back to clause 1
+ * after the last: the condition of while, or for dotimes and for-each
+ * the source, which is kept as the frame's first value once the loop
+ * frame is entered, and then binding the variable.
+ */
+
+/* Finish loop frame f with value x */
+void leval_end(leval* m, lframe* f, lval* x) {
+  if (f->loop) {
+    leval_unloop(m, f);
+    lval_del(leval_take(m, f, 0));
+  }
+  leval_pop(m, x);
+}
+
+void leval_loop(leval* m, lframe* f) {
+  
+  lval** v = m->vals + f->base;
+  lval* code = f->code;
+  int first = f->form == builtin_while ? 2 : 3;
+  long num = 0;
+  lval* x = NULL;
+  
+  if (f->clause == code->count) { f->clause = 1; return; }
+  
+  if (f->clause == 1 && f->loop) {
+    if (!lenv_iterate(f->loop, v[0], f->index)) {
+      leval_end(m, f, lval_sexpr());
+      return;
+    }
+    f->index++;
+    f->clause = first;
+    return;
+  }
+  
+  /* Evaluate the cell, in a frame above unless it is typed */
+  if (f->n > (f->loop != NULL)) {
+    x = v[--f->n];
+  } else {
+    lval* c = code->cell[f->clause == 1 ? first - 1 : f->clause];
+    if (c->type == LVAL_SEXPR) {
+      if (!c->builtin || larith_eval(f->env, c, &num) != LARITH_OK) {
+        leval_push(m, f->env, c, NULL);
+        return;
+      }
+    } else {
+      x = c->type == LVAL_SYM ? lenv_get(f->env, c) : lval_copy(c);
+    }
+  }
+  
+  /* Bodies are run for what they do, unless they give an error */
+  if (f->clause > 1) {
+    if (x && x->type == LVAL_ERR) { leval_end(m, f, x); return; }
+    if (x) { lval_del(x); }
+    f->clause++;
+    return;
+  }
+  
+  if (f->form == builtin_while) {
+    if (x) {
+      lval* err = lval_test(x, "while");
+      if (err) { leval_end(m, f, err); return; }
+      num = x->num;
+      lval_del(x);
+    }
+    if (!num) { leval_end(m, f, lval_sexpr()); return; }
+    f->clause = first;
+    return;
+  }
+  
+  if (!x) { x = lval_num(num); }
+  lval* err = lval_source(x, f->form);
+  if (err) { lval_del(x); leval_end(m, f, err); return; }
+  v[f->n++] = x;
+  f->loop = lenv_loop(f->env, code->cell[1]->cell[0]);
+  f->env = f->loop;
+  f->index = 0;
+}
+
+/*
+ * Run for at most budget steps, or until finished if budget is
+ * negative. Returns 1 once the evaluation is finished.
+ */
+int leval_run(leval* m, long budget) {
+  
+  while (m->count) {
+    if (budget >= 0 && budget-- == 0) { return 0; }
+    hoagie_stats.steps++;
+    
+    lframe* f = &m->frames[m->count-1];
+    lval** v = m->vals + f->base;
+    
+    /* Store the value of the cell the frame above was evaluating */
+    if (m->result) {
+      v[f->n++] = m->result;
+      m->result = NULL;
+      continue;
+    }
+    
+    if (f->form) {
+      if (lval_is_loop(f->form)) { leval_loop(m, f); } else { leval_form(m, f); }
+      continue;
+    }
+    
+    /* Typed arithmetic needs no frame, unless it goes wrong */
+    long num;
+    if (f->n == 0 && f->code->builtin
+        && larith_eval(f->env, f->code, &num) == LARITH_OK) {
+      leval_pop(m, lval_num(num));
+      continue;
+    }
+    
+    if (f->n == 0 && f->code->form) {
+      f->form = f->code->form;
+      f->clause = 1;
+      continue;
+    }
+    
+    if (f->n == f->code->count) { leval_apply(m); continue; }
+    
+    lval* x = f->code->cell[f->n];
+    if (x->type == LVAL_SEXPR) {
+      if (x->builtin && larith_eval(f->env, x, &num) == LARITH_OK) {
+        v[f->n++] = lval_num(num);
+        continue;
+      }
+      leval_push(m, f->env, x, NULL);
+      continue;
+    }
+    
+    /* The function called can come from the call site cache */
+    if (f->n == 0 && f->code->count > 1 && x->type == LVAL_SYM) {
+      lval* fn = lcache_fn(f->env, x);
+      if (fn) {
+        v[f->n++] = fn;
+        f->borrowed = 1;
+        continue;
+      }
+    }
+    v[f->n++] = x->type == LVAL_SYM ? lenv_get(f->env, x) : lval_copy(x);
+  }
+  return 1;
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+  if (v->type == LVAL_SYM) {
+    lval* x = lenv_get(e, v);
+    lval_del(v);
+    return x;
+  }
+  if (v->type != LVAL_SEXPR) { return v; }
+  
+  leval* m = leval_new(e, v);
+  leval_run(m, -1);
+  return leval_del(m);
+}
+
+/* Bytecode */
+
+/*
+ * Opcodes. Operands follow the opcode as 16-bit little endian values,
+ * and a chunk with one too big is left to the tree evaluator. Jumps
+ * only go forwards, except back to the head of a loop. IF and COND pop
+ * a condition and jump to their operand if it is 0, AND jumps there
+ * keeping a 0, and OR anything else. A condition which is not a number
+ * jumps to the instruction before the target instead, which
+ * always leaves the form, so the error becomes its value: the JUMP to
+ * the end of the form, or a RET.
+ *
+ * Loop instructions are the other way round. Their operand is the exit
+ * of the loop, which a value on top leaves it with, and the instruction
+ * before it pushes () for a loop which is done. WHILE pops a condition,
+ * DROP pops the value of a body, and either jumps to the exit with an
+ * error. ENTER starts a loop frame binding constant operand, with the
+ * count of times round pushed above the source. DOTIMES and FOREACH
+ * bind the next value in it, and LEAVE drops the count and source.
+ */
+enum { OP_CONST, OP_GET, OP_CALL, OP_TAILCALL, OP_RET,
+       OP_JUMP, OP_IF, OP_COND, OP_AND, OP_OR,
+       OP_WHILE, OP_DROP, OP_ENTER, OP_DOTIMES, OP_FOREACH, OP_LEAVE };
+
+char* lop_name(int op) {
+  switch(op) {
+    case OP_CONST: return "CONST";
+    case OP_GET: return "GET";
+    case OP_CALL: return "CALL";
+    case OP_TAILCALL: return "TAILCALL";
+    case OP_RET: return "RET";
+    case OP_JUMP: return "JUMP";
+    case OP_IF: return "IF";
+    case OP_COND: return "COND";
+    case OP_AND: return "AND";
+    case OP_OR: return "OR";
+    case OP_WHILE: return "WHILE";
+    case OP_DROP: return "DROP";
+    case OP_ENTER: return "ENTER";
+    case OP_DOTIMES: return "DOTIMES";
+    case OP_FOREACH: return "FOREACH";
+    case OP_LEAVE: return "LEAVE";
+    default: return "UNKNOWN";
+  }
+}
+
+typedef struct lchunk {
+  int count;
+  unsigned char* code;
+
+  int nconsts;
+  lval** consts;
+
+  /* Deepest the value stack can grow while running this chunk */
+  int depth;
+  int max_depth;
+
+  /* An operand did not fit in 16 bits, so the tree evaluator runs it */
+  int oversized;
+
+  /* Times run, and native code once the JIT has compiled it */
+  int calls;
+  int jit_failed;
+  void* native;
+
+  /* Specialized trace recorded once the chunk got hot */
+  struct ltrace* trace;
+  int trace_failed;
+
+  /* Lambda bodies are shared by every copy of the lambda */
+  int refs;
+  
+  /* Lambda formals and body as written, shared by every copy */
+  lval* formals;
+  lval* source;
+  
+  /* Simplified lambda body compiled, run as is by the tree evaluator */
+  lval* body;
+  
+  /* Inlined somewhere, so redefining the lambda undoes simplifications */
+  int inlined;
+  
+  /* lsimp_epoch the body was simplified in, and the chunk made since */
+  long epoch;
+  struct lchunk* fresh;
+  
+  /* Chunks with a body are all linked together, see lcache_flush */
+  struct lchunk* prev;
+  struct lchunk* next;
+} lchunk;
+
+lchunk* lchunk_bodies = NULL;
+
+lchunk* lchunk_new(void) {
+  lchunk* c = malloc(sizeof(lchunk));
+  c->count = 0;
+  c->code = NULL;
+  c->nconsts = 0;
+  c->consts = NULL;
+  c->depth = 0;
+  c->max_depth = 0;
+  c->oversized = 0;
+  c->calls = 0;
+  c->jit_failed = 0;
+  c->native = NULL;
+  c->trace = NULL;
+  c->trace_failed = 0;
+  c->refs = 1;
+  c->formals = NULL;
+  c->source = NULL;
+  c->body = NULL;
+  c->inlined = 0;
+  c->epoch = lsimp_epoch;
+  c->fresh = NULL;
+  c->prev = NULL;
+  c->next = NULL;
+  return c;
+}
+
+void ltrace_del(struct ltrace* t);
+void ljit_free(void* code);
+
+void lchunk_del(lchunk* c) {
+  #ifdef HOAGIE_JIT
+  if (c->trace) { ltrace_del(c->trace); }
+  ljit_free(c->native);
+  #endif
+  for (int i = 0; i < c->nconsts; i++) {
+    lval_del(c->consts[i]);
+  }
+  free(c->consts);
+  free(c->code);
+  if (c->formals) { lval_del(c->formals); }
+  if (c->source) { lval_del(c->source); }
+  if (c->fresh) { lchunk_release(c->fresh); }
+  if (c->body) {
+    if (c->prev) { c->prev->next = c->next; } else { lchunk_bodies = c->next; }
+    if (c->next) { c->next->prev = c->prev; }
+    lval_del(c->body);
+  }
+  free(c);
+}
+
+void lchunk_retain(lchunk* c) { c->refs++; }
+
+void lchunk_release(lchunk* c) {
+  if (--c->refs == 0) { lchunk_del(c); }
+}
+
+/* Empty the call site caches in code x */
+void lcache_clear(lval* x) {
+  if (x->type == LVAL_SYM && x->cached) {
+    lcache_retire(x->cached);
+    x->cached = NULL;
+  }
+  if (x->type == LVAL_SEXPR) {
+    for (int i = 0; i < x->count; i++) { lcache_clear(x->cell[i]); }
+  }
+}
+
+/*
+ * Empty the caches in every lambda body once a global is redefined. A
+ * recursive lambda caches a copy of itself, which keeps its body alive,
+ * so they would otherwise never be freed.
+ */
+void lcache_flush(void) {
+  for (lchunk* c = lchunk_bodies; c; c = c->next) { lcache_clear(c->body); }
+}
+
+void lchunk_emit(lchunk* c, int op, int arg) {
+  if (arg > 0xFFFF) { c->oversized = 1; }
+  c->code = realloc(c->code, c->count + 3);
+  c->code[c->count++] = op;
+  c->code[c->count++] = arg & 0xFF;
+  c->code[c->count++] = (arg >> 8) & 0xFF;
+}
+
+/* Point the jump at offset at to target */
+void lchunk_patch(lchunk* c, int at, int target) {
+  if (target > 0xFFFF) { c->oversized = 1; }
+  c->code[at+1] = target & 0xFF;
+  c->code[at+2] = (target >> 8) & 0xFF;
+}
+
+/* Track how the emitted instruction moves the stack */
+void lchunk_stack(lchunk* c, int delta) {
+  c->depth += delta;
+  if (c->depth > c->max_depth) { c->max_depth = c->depth; }
+}
+
+int lchunk_const(lchunk* c, lval* v) {
+  c->nconsts++;
+  c->consts = realloc(c->consts, sizeof(lval*) * c->nconsts);
+  c->consts[c->nconsts-1] = v;
+  return c->nconsts-1;
+}
+
+/* Compilation */
+
+void lval_compile_form(lchunk* c, lval* v, int tail);
+void lval_compile_loop(lchunk* c, lval* v);
+
+/* Compile v, returning its value if it is in tail position */
+void lval_compile_expr(lchunk* c, lval* v, int tail) {
+  switch (v->type) {
+    case LVAL_SYM:
+      lchunk_emit(c, OP_GET, lchunk_const(c, lval_copy(v)));
+      lchunk_stack(c, 1);
+      break;
+    case LVAL_SEXPR:
+      /* Single element S-Expressions evaluate to their element */
+      if (v->count == 1) { lval_compile_expr(c, v->cell[0], tail); return; }
+      if (v->form && lval_is_loop(v->form)) { lval_compile_loop(c, v); break; }
+      if (v->form) { lval_compile_form(c, v, tail); return; }
+      if (v->count > 1) {
+        for (int i = 0; i < v->count; i++) {
+          lval_compile_expr(c, v->cell[i], 0);
+        }
+        lchunk_emit(c, OP_CALL, v->count-1);
+        lchunk_stack(c, -(v->count-1));
+        break;
+      }
+      /* Empty S-Expressions evaluate to themselves */
+    default:
+      lchunk_emit(c, OP_CONST, lchunk_const(c, lval_copy(v)));
+      lchunk_stack(c, 1);
+      break;
+  }
+  
+  if (tail) {
+    /* A call whose result is returned directly is a tail call */
+    if (c->code[c->count-3] == OP_CALL) { c->code[c->count-3] = OP_TAILCALL; }
+    lchunk_emit(c, OP_RET, 0);
+    lchunk_stack(c, -1);
+  }
+}
+
+/*
+ * Special forms become jumps. In tail position each branch returns for
+ * itself, otherwise they all jump to the end of the form. A test of the
+ * wrong type goes to the instruction before its target instead, which
+ * always returns or jumps to the end, taking the error with it.
+ */
+void lval_compile_form(lchunk* c, lval* v, int tail) {
+  int depth = c->depth;
+  int last = v->count - 1;
+  int* ends = malloc(sizeof(int) * v->count);
+  int nends = 0;
+  
+  if (v->form == builtin_and || v->form == builtin_or) {
+    int op = v->form == builtin_and ? OP_AND : OP_OR;
+    for (int i = 1; i < last; i++) {
+      lval_compile_expr(c, v->cell[i], 0);
+      ends[nends++] = c->count;
+      lchunk_emit(c, op, 0);
+      lchunk_stack(c, -1);
+    }
+    lval_compile_expr(c, v->cell[last], tail);
+    
+    /* Operands which ended it early are returned from the end */
+    if (tail) {
+      c->depth = depth + 1;
+      for (int i = 0; i < nends; i++) { lchunk_patch(c, ends[i], c->count); }
+      nends = 0;
+      lchunk_emit(c, OP_RET, 0);
+      lchunk_stack(c, -1);
+    } else {
+      lchunk_emit(c, OP_JUMP, c->count + 3);
+    }
+  } else {
+    int op = v->form == builtin_if ? OP_IF : OP_COND;
+    int i = 1;
+    for (; i < last; i += 2) {
+      lval_compile_expr(c, v->cell[i], 0);
+      int test = c->count;
+      lchunk_emit(c, op, 0);
+      lchunk_stack(c, -1);
+      lval_compile_expr(c, v->cell[i+1], tail);
+      if (!tail) {
+        ends[nends++] = c->count;
+        lchunk_emit(c, OP_JUMP, 0);
+      }
+      c->depth = depth;
+      lchunk_patch(c, test, c->count);
+    }
+    
+    /* The last branch, or () if no branch was taken */
+    if (i == last) {
+      lval_compile_expr(c, v->cell[i], tail);
+    } else {
+      lval* x = lval_sexpr();
+      lval_compile_expr(c, x, tail);
+      lval_del(x);
+    }
+  }
+  
+  for (int i = 0; i < nends; i++) { lchunk_patch(c, ends[i], c->count); }
+  free(ends);
+}
+
+/* Loops jump back to their head, then out past () once they are done */
+void lval_compile_loop(lchunk* c, lval* v) {
+  int var = v->form != builtin_while;
+  int first = var ? 3 : 2;
+  int* exits = malloc(sizeof(int) * v->count);
+  int nexits = 0;
+  
+  if (var) {
+    lval_compile_expr(c, v->cell[2], 0);
+    lchunk_emit(c, OP_ENTER, lchunk_const(c, lval_copy(v->cell[1]->cell[0])));
+    lchunk_stack(c, 1);
+  }
+  int head = c->count;
+  if (var) {
+    exits[nexits++] = c->count;
+    lchunk_emit(c, v->form == builtin_dotimes ? OP_DOTIMES : OP_FOREACH, 0);
+  } else {
+    lval_compile_expr(c, v->cell[1], 0);
+    exits[nexits++] = c->count;
+    lchunk_emit(c, OP_WHILE, 0);
+    lchunk_stack(c, -1);
+  }
+  for (int i = first; i < v->count; i++) {
+    lval_compile_expr(c, v->cell[i], 0);
+    exits[nexits++] = c->count;
+    lchunk_emit(c, OP_DROP, 0);
+    lchunk_stack(c, -1);
+  }
+  lchunk_emit(c, OP_JUMP, head);
+  
+  lval* x = lval_sexpr();
+  lval_compile_expr(c, x, 0);
+  lval_del(x);
+  for (int i = 0; i < nexits; i++) { lchunk_patch(c, exits[i], c->count); }
+  free(exits);
+  
+  if (var) {
+    lchunk_emit(c, OP_LEAVE, 0);
+    lchunk_stack(c, -2);
+  }
+}
+
+lchunk* lval_compile(lval* v) {
+  lchunk* c = lchunk_new();
+  lval_compile_expr(c, v, 1);
+  return c;
+}
+
+lval* lval_simplify_body(lenv* e, lval* formals, lval* body);
+
+/*
+ * Lambda bodies are Q-Expressions run as S-Expressions. The chunk takes
+ * ownership of the formals and body, made in environment e.
+ */
+lchunk* lval_compile_body(lenv* e, lval* formals, lval* body) {
+  lval* x = lval_simplify_body(e, formals, body);
+  lchunk* c = lval_compile(x);
+  c->formals = formals;
+  c->source = body;
+  c->body = x;
+  c->next = lchunk_bodies;
+  if (lchunk_bodies) { lchunk_bodies->prev = c; }
+  lchunk_bodies = c;
+  return c;
+}
+
+lval* lchunk_body(lchunk* c) { return c->body; }
+
+void lchunk_print(lchunk* c) {
+  for (int i = 0; i < c->count; i += 3) {
+    int arg = c->code[i+1] | (c->code[i+2] << 8);
+    printf("%04i %-6s", i, lop_name(c->code[i]));
+    switch (c->code[i]) {
+      case OP_CONST:
+      case OP_GET:
+      case OP_ENTER: printf("%i ; ", arg); lval_print(c->consts[arg]); break;
+      case OP_CALL:
+      case OP_TAILCALL: printf("%i", arg); break;
+      case OP_JUMP:
+      case OP_IF:
+      case OP_COND:
+      case OP_AND:
+      case OP_OR:
+      case OP_WHILE:
+      case OP_DROP:
+      case OP_DOTIMES:
+      case OP_FOREACH: printf("%04i", arg); break;
+    }
+    putchar('\n');
+  }
+}
+
+/* Simplification */
+
+/*
+ * Before an expression is evaluated, calls to pure builtins on literal
+ * arguments are folded into their value, joins of lists are flattened
+ * into one list, (x) is replaced by x, and calls to small lambdas are
+ * replaced by their bodies. Q-Expressions are data and are left alone,
+ * except for lambda bodies, which are simplified when the lambda is
+ * made.
+ */
+
+int hoagie_dump_simplified = 0;
+int hoagie_explain = 0;
+
+int lvm_is_arith(lbuiltin f);
+
+/*
+ * Builtins which cannot change the environment. Conditionals only could
+ * by running a Q-Expression, and as special forms those are code which
+ * is checked itself.
+ */
+int lval_is_pure(lbuiltin f) {
+  return lvm_is_arith(f) || lval_is_compare(f) || lval_is_cond(f)
+      || f == builtin_list || f == builtin_head
+      || f == builtin_tail || f == builtin_join || f == builtin_take
+      || f == builtin_sort || f == builtin_uniq || lreader_of(f) != NULL;
+}
+
+/* Names bound around code, innermost first: loop variables, then formals */
+typedef struct lscope {
+  lval* names;
+  struct lscope* par;
+} lscope;
+
+typedef struct {
+  /* Where symbols are looked up, and the names which shadow it */
+  lenv* env;
+  lscope* scope;
+  
+  /* Set once a call which might redefine things has been passed */
+  int barrier;
+} lsimp;
+
+/* Slot of symbol x in a frame for formals, or -1. The '&' has none. */
+int lsimp_formal(lval* formals, lval* x) {
+  if (!formals) { return -1; }
+  for (int i = 0, j = 0; i < formals->count; i++) {
+    if (lval_is_rest(formals->cell[i])) { continue; }
+    if (strcmp(formals->cell[i]->sym, x->sym) == 0) { return j; }
+    j++;
+  }
+  return -1;
+}
+
+/* Is symbol x bound by the scope s simplifies in, rather than its env */
+int lsimp_local(lsimp* s, lval* x) {
+  for (lscope* t = s->scope; t; t = t->par) {
+    if (lsimp_formal(t->names, x) >= 0) { return 1; }
+  }
+  return 0;
+}
+
+/* The binding symbol x is certain to have, or NULL */
+lval* lsimp_lookup(lsimp* s, lval* x) {
+  if (x->type != LVAL_SYM || lsimp_local(s, x)) { return NULL; }
+  return lenv_peek(s->env, x);
+}
+
+/* The builtin symbol x is certain to be bound to, or NULL */
+lbuiltin lsimp_builtin(lsimp* s, lval* x) {
+  lval* v = lsimp_lookup(s, x);
+  return v && v->type == LVAL_FUN ? v->builtin : NULL;
+}
+
+/* Does x evaluate to itself */
+int lsimp_literal(lval* x) {
+  return x->type == LVAL_NUM || x->type == LVAL_QEXPR;
+}
+
+/* Is x known to evaluate to a Q-Expression, and a list call if so */
+int lsimp_is_list(lsimp* s, lval* x) {
+  if (x->type == LVAL_QEXPR) {
+    for (int i = 0; i < x->count; i++) {
+      if (!lsimp_literal(x->cell[i])) { return 0; }
+    }
+    return 1;
+  }
+  return x->type == LVAL_SEXPR && x->count > 1
+    && lsimp_builtin(s, x->cell[0]) == builtin_list;
+}
+
+/* (join {a b} (list c) {d}) is (list a b c d) */
+lval* lsimp_join(lsimp* s, lval* v) {
+  lval* list = NULL;
+  for (int i = 1; i < v->count; i++) {
+    if (!lsimp_is_list(s, v->cell[i])) { return v; }
+    if (v->cell[i]->type == LVAL_SEXPR && !list) { list = v->cell[i]->cell[0]; }
+  }
+  if (!list) { return v; }
+  
+  lval* x = lval_add(lval_sexpr(), lval_copy(list));
+  for (int i = 1; i < v->count; i++) {
+    lval* y = v->cell[i];
+    for (int j = y->type == LVAL_SEXPR; j < y->count; j++) {
+      x = lval_add(x, lval_copy(y->cell[j]));
+    }
+  }
+  lval_del(v);
+  return x;
+}
+
+/* Lambdas with bodies of at most this many values may be inlined */
+#define LSIMP_INLINE_SIZE 16
+
+int lsimp_size(lval* v) {
+  int n = 1;
+  if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+    for (int i = 0; i < v->count; i++) { n += lsimp_size(v->cell[i]); }
+  }
+  return n;
+}
+
+/* Evaluating x cannot change anything, though it may be an error */
+int lsimp_pure(lsimp* s, lval* x) {
+  if (x->type != LVAL_SEXPR) { return 1; }
+  if (x->count > 1) {
+    lbuiltin f = lsimp_builtin(s, x->cell[0]);
+    if (!f || !lval_is_pure(f)) { return 0; }
+  }
+  for (int i = 0; i < x->count; i++) {
+    if (!lsimp_pure(s, x->cell[i])) { return 0; }
+  }
+  return 1;
+}
+
+/* Is x bound anywhere but the globals, as seen from where s simplifies */
+int lsimp_shadowed(lsimp* s, lval* x) {
+  if (lsimp_local(s, x)) { return 1; }
+  for (lenv* e = s->env; e->par; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], x->sym) == 0) { return 1; }
+    }
+  }
+  return 0;
+}
+
+/* Evaluating x can be repeated or moved freely */
+int lsimp_trivial(lsimp* s, lval* x) {
+  if (lsimp_literal(x)) { return 1; }
+  return x->type == LVAL_SYM
+    && (lsimp_local(s, x) || lenv_peek(s->env, x));
+}
+
+/* What inlining call v to a lambda has found out about its body */
+typedef struct {
+  lenv* g;
+  lval* formals;
+  lval* call;
+  
+  /* Uses of each formal, and whether any came after a call finished */
+  int* uses;
+  int* late;
+  
+  int calls;
+  int last;
+  
+  /* Inside a cell a special form may not evaluate */
+  int cond;
+} linline;
+
+/*
+ * Can x, from the simplified body of a lambda made in g, run in place
+ * of a call to it. It must only call pure builtins, so cannot recurse.
+ * Anything but its formals must be a bound global, not shadowed at the
+ * call site.
+ */
+int lsimp_inlinable(lsimp* s, linline* in, lval* x) {
+  if (x->type == LVAL_SYM) {
+    int i = lsimp_formal(in->formals, x);
+    if (i < 0) {
+      return x->global && lenv_peek(in->g, x) && !lsimp_shadowed(s, x);
+    }
+    in->uses[i]++;
+    in->late[i] |= in->calls > 0;
+    
+    /* Arguments which may be errors must still be evaluated, in order */
+    if (!lsimp_trivial(s, in->call->cell[i+1])) {
+      if (i < in->last || in->cond) { return 0; }
+      in->last = i;
+    }
+    return 1;
+  }
+  if (x->type != LVAL_SEXPR) { return 1; }
+  
+  if (x->count > 1) {
+    lval* f = x->cell[0];
+    if (f->type != LVAL_SYM || !f->global) { return 0; }
+    f = lenv_peek(in->g, f);
+    if (!f || f->type != LVAL_FUN || !f->builtin || !lval_is_pure(f->builtin)) {
+      return 0;
+    }
+  }
+  int cond = in->cond;
+  for (int i = 0; i < x->count; i++) {
+    if (x->form && i == 2) { in->cond = 1; }
+    if (!lsimp_inlinable(s, in, x->cell[i])) { return 0; }
+  }
+  in->cond = cond;
+  if (x->count > 1) { in->calls++; }
+  return 1;
+}
+
+/* Replace formals with the matching arguments of call v */
+lval* lsimp_subst(lval* x, lval* formals, lval* v) {
+  if (x->type == LVAL_SYM) {
+    int i = lsimp_formal(formals, x);
+    if (i < 0) { return x; }
+    lval_del(x);
+    return lval_copy(v->cell[i+1]);
+  }
+  if (x->type == LVAL_SEXPR) {
+    for (int i = 0; i < x->count; i++) {
+      x->cell[i] = lsimp_subst(x->cell[i], formals, v);
+    }
+  }
+  return x;
+}
+
+lval* lval_simplify(lsimp* s, lval* v);
+
+/*
+ * Inline call v to lambda f, or return NULL. Every formal must be used
+ * so no error is lost. Arguments which are not trivial must be pure,
+ * used once, and reached in order before the body has done anything
+ * which could be an error, so the same error is reported first.
+ */
+lval* lsimp_inline(lsimp* s, lval* v, lval* f) {
+  int n = v->count - 1;
+  if (f->formals->count != n || lval_rest(f->formals) >= 0) { return NULL; }
+  for (int i = 1; i < v->count; i++) {
+    if (!lsimp_pure(s, v->cell[i])) { return NULL; }
+  }
+  
+  lsimp_refresh(f);
+  lval* body = f->chunk->body;
+  if (lsimp_size(body) > LSIMP_INLINE_SIZE) { return NULL; }
+  
+  linline in = { f->env, f->formals, v, NULL, NULL, 0, -1, 0 };
+  in.uses = calloc(n + 1, sizeof(int));
+  in.late = calloc(n + 1, sizeof(int));
+  int ok = lsimp_inlinable(s, &in, body);
+  for (int i = 0; i < n; i++) {
+    ok &= in.uses[i] > 0;
+    if (!lsimp_trivial(s, v->cell[i+1])) { ok &= in.uses[i] == 1 && !in.late[i]; }
+  }
+  free(in.uses);
+  free(in.late);
+  if (!ok) { return NULL; }
+  
+  /* Redefining f must now redo this simplification */
+  f->chunk->inlined = 1;
+  
+  lval* x = lsimp_subst(lval_copy(body), f->formals, v);
+  lval_del(v);
+  return lval_simplify(s, x);
+}
+
+/* Evaluating x cannot go wrong or change anything: trivial, or a lambda */
+int lsimp_safe(lsimp* s, lval* x) {
+  if (lsimp_trivial(s, x)) { return 1; }
+  if (x->type != LVAL_SEXPR || x->count != 3
+      || lsimp_builtin(s, x->cell[0]) != builtin_lambda
+      || x->cell[1]->type != LVAL_QEXPR || x->cell[2]->type != LVAL_QEXPR) {
+    return 0;
+  }
+  for (int i = 0; i < x->cell[1]->count; i++) {
+    if (x->cell[1]->cell[i]->type != LVAL_SYM) { return 0; }
+  }
+  return 1;
+}
+
+int lval_is_pipe(lval* x) {
+  return x->type == LVAL_SEXPR && x->count > 1
+    && x->cell[0]->type == LVAL_FUN && x->cell[0]->builtin == builtin_pipe;
+}
+
+/*
+ * Fuse call v to a list function with the one giving its list into a
+ * pipeline, see builtin_pipe. Its other arguments must be safe, as the
+ * pipeline runs no stage until every argument is evaluated, and they
+ * are evaluated before any stage of the calls would run anyway.
+ */
+lval* lsimp_fuse(lsimp* s, lval* v) {
+  lstage* outer = lstage_of(lsimp_builtin(s, v->cell[0]));
+  if (!outer || v->count != outer->args + 2) { return v; }
+  for (int i = 1; i <= outer->args; i++) {
+    if (!lsimp_safe(s, v->cell[i])) { return v; }
+  }
+  
+  lval* in = v->cell[v->count-1];
+  if (in->type != LVAL_SEXPR || in->count < 2) { return v; }
+  if (!lval_is_pipe(in)) {
+    lstage* inner = lstage_of(lsimp_builtin(s, in->cell[0]));
+    if (!inner || !inner->list || in->count != inner->args + 2) { return v; }
+    lval_del(in->cell[0]);
+    in->cell[0] = lval_add(lval_qexpr(), lval_sym(inner->name));
+    in = lval_add(lval_sexpr(), lval_fun(builtin_pipe));
+    in = lval_join(in, v->cell[v->count-1]);
+  } else if (!lstage_named(in->cell[1]->cell[0]->sym)->list) {
+    return v;
+  }
+  
+  /* The new stage goes first, then its arguments before the rest */
+  lval* x = lval_add(lval_sexpr(), lval_pop(in, 0));
+  lval* stages = lval_pop(in, 0);
+  x = lval_add(x, lval_join(lval_add(lval_qexpr(), lval_sym(outer->name)), stages));
+  for (int i = 1; i <= outer->args; i++) { x = lval_add(x, lval_copy(v->cell[i])); }
+  x = lval_join(x, in);
+  
+  v->count--;
+  lval_del(v);
+  return x;
+}
+
+/*
+ * The special form call v is, or NULL. Branches of if and cond given as
+ * Q-Expressions are run, so they are made S-Expressions to be simplified
+ * along with the rest. Forms are settled here even past a barrier, as
+ * evaluating them as calls would run every branch.
+ */
+/* Does loop v name a single variable, as dotimes and for-each need */
+int lsimp_is_var(lval* v) {
+  lval* x = v->cell[1];
+  return x->type == LVAL_QEXPR && x->count == 1 && x->cell[0]->type == LVAL_SYM;
+}
+
+lbuiltin lsimp_form(lsimp* s, lval* v) {
+  lbuiltin f = lsimp_builtin(s, v->cell[0]);
+  if (!lval_is_form(f) || (f == builtin_if && v->count != 4)) { return NULL; }
+  
+  if (f == builtin_if || f == builtin_cond) {
+    for (int i = 2; i < v->count; i += 2) {
+      if (v->cell[i]->type == LVAL_QEXPR) { v->cell[i]->type = LVAL_SEXPR; }
+    }
+    lval* x = v->cell[v->count-1];
+    if (v->count % 2 == 0 && x->type == LVAL_QEXPR) { x->type = LVAL_SEXPR; }
+  }
+  
+  /* Likewise the condition and bodies of loops, given a variable if needed */
+  if (lval_is_loop(f)) {
+    int first = f == builtin_while ? 1 : 3;
+    if (f != builtin_while && (v->count < 3 || !lsimp_is_var(v))) { return NULL; }
+    for (int i = first; i < v->count; i++) {
+      if (v->cell[i]->type == LVAL_QEXPR) { v->cell[i]->type = LVAL_SEXPR; }
+    }
+  }
+  return f;
+}
+
+/*
+ * The cells of loop v after its head are run over and over, so nothing
+ * in them may be assumed. The variable of dotimes and for-each shadows
+ * everything else in their bodies.
+ */
+void lsimp_loop(lsimp* s, lval* v) {
+  int first = v->form == builtin_while ? 1 : 3;
+  for (int i = 0; i < first; i++) {
+    v->cell[i] = lval_simplify(s, v->cell[i]);
+  }
+  
+  lscope scope = { v->cell[1], s->scope };
+  if (v->form != builtin_while) { s->scope = &scope; }
+  s->barrier = 1;
+  for (int i = first; i < v->count; i++) {
+    v->cell[i] = lval_simplify(s, v->cell[i]);
+  }
+  s->scope = scope.par;
+}
+
+lval* lval_simplify(lsimp* s, lval* v) {
+  if (v->type != LVAL_SEXPR) { return v; }
+  
+  /* (x) evaluates to x */
+  while (v->count == 1) {
+    v = lval_take(v, 0);
+    if (v->type != LVAL_SEXPR) { return v; }
+  }
+  if (v->count == 0) { return v; }
+  int barrier = s->barrier;
+  
+  v->form = lsimp_form(s, v);
+  if (lval_is_loop(v->form)) {
+    lsimp_loop(s, v);
+  } else {
+    for (int i = 0; i < v->count; i++) {
+      v->cell[i] = lval_simplify(s, v->cell[i]);
+    }
+  }
+  
+  /* Unless the list functions could have been rebound by now */
+  if (!barrier && !v->form) { v = lsimp_fuse(s, v); }
+  
+  lval* fn = lsimp_lookup(s, v->cell[0]);
+  if (!s->barrier && fn && fn->type == LVAL_FUN && !fn->builtin) {
+    lval* x = lsimp_inline(s, v, fn);
+    if (x) { return x; }
+  }
+  
+  lbuiltin f = lsimp_builtin(s, v->cell[0]);
+  if (!f || !lval_is_pure(f)) { s->barrier = 1; return v; }
+  if (s->barrier) { return v; }
+  
+  for (int i = 1; i < v->count; i++) {
+    if (!lsimp_literal(v->cell[i])) {
+      return f == builtin_join ? lsimp_join(s, v) : v;
+    }
+  }
+  
+  /*
+   * Fold, unless it is an error best left to run time, or a value such
+   * as a symbol from nth which would mean something else as code
+   */
+  lval* a = lval_sexpr();
+  for (int i = 1; i < v->count; i++) { a = lval_add(a, lval_copy(v->cell[i])); }
+  lval* x = f(s->env, a);
+  if (!lsimp_literal(x)) { lval_del(x); return v; }
+  lval_del(v);
+  return x;
+}
+
+/*
+ * Give each symbol in code x its lexical address, for code run in the
+ * frames of scope inside environment e. A call frame holds the formals
+ * in order, so formal i is slot i, and a loop frame its variable alone.
+ * Frames closures are made in never change, so their slots are fixed
+ * too. Anything else names a global, and points at its value cell.
+ * Q-Expressions are data, and are looked up by name if ever evaluated.
+ */
+/* Make a call of a global reader on a variable read it there, see builtin_ref */
+void lval_resolve_ref(lval* x) {
+  if (x->count < 2) { return; }
+  lval* h = x->cell[0];
+  lval* l = x->cell[x->count-1];
+  lreader* r = NULL;
+  if (h->type == LVAL_SYM && h->global && h->global->type == LVAL_FUN) {
+    r = lreader_of(h->global->builtin);
+  }
+  if (!r || x->count != r->args + 2 || l->type != LVAL_SYM) { return; }
+  
+  for (int i = x->count - 1; i > 1; i--) { x->cell[i] = x->cell[i-1]; }
+  x->cell[1] = lval_add(lval_add(lval_qexpr(), h), l);
+  x->cell[0] = lval_fun(builtin_ref);
+}
+
+void lval_resolve(lenv* e, lval* x, lscope* scope) {
+  if (x->type == LVAL_SYM) {
+    x->depth = -1;
+    x->slot = -1;
+    x->global = NULL;
+    for (lscope* t = scope; t && x->slot < 0; t = t->par) {
+      x->depth++;
+      x->slot = lsimp_formal(t->names, x);
+    }
+    while (x->slot < 0 && e->par) {
+      x->depth++;
+      for (int i = 0; i < e->count && x->slot < 0; i++) {
+        if (strcmp(e->syms[i], x->sym) == 0) { x->slot = i; }
+      }
+      if (x->slot < 0) { e = e->par; }
+    }
+    if (x->slot < 0) {
+      x->depth = 0;
+      x->global = lenv_cell(e, x);
+    }
+  }
+  if (x->type == LVAL_SEXPR) {
+    int var = x->form && lval_is_loop(x->form) && x->form != builtin_while;
+    lscope inner = { var ? x->cell[1] : NULL, scope };
+    for (int i = 0; i < x->count; i++) {
+      lval_resolve(e, x->cell[i], var && i > 2 ? &inner : scope);
+    }
+    lval_resolve_ref(x);
+  }
+}
+
+/*
+ * Type inference, over code after it is resolved. Each S-Expression
+ * applying an arithmetic builtin to numbers is marked with it, so the
+ * evaluator can compute it unboxed with larith_eval. So is a comparison
+ * of two numbers, and an if whose condition and branches are numbers.
+ * Literals and marked expressions are known to be numbers. Symbols are
+ * assumed to be, as larith_eval checks them when read, and heads must
+ * be resolved to the global the builtin is bound to. Returns whether x
+ * is known to give a number, or an arithmetic error.
+ */
+int lval_infer(lval* x) {
+  if (x->type == LVAL_NUM) { return 1; }
+  if (x->type != LVAL_SEXPR) { return 0; }
+  
+  x->builtin = NULL;
+  int nums = x->count > 1;
+  for (int i = 0; i < x->count; i++) {
+    int num = lval_infer(x->cell[i]) || x->cell[i]->type == LVAL_SYM;
+    if (i > 0) { nums &= num; }
+  }
+  if (!nums) { return 0; }
+  
+  lval* h = x->cell[0];
+  if (h->type != LVAL_SYM || !h->global || h->global->type != LVAL_FUN) { return 0; }
+  lbuiltin f = h->global->builtin;
+  if (f == builtin_if ? x->form != f : !larith_step(f)) { return 0; }
+  if (lval_is_compare(f) && x->count != 3) { return 0; }
+  x->builtin = f;
+  return 1;
+}
+
+/* Do formals name distinct slots */
+int lval_formals_distinct(lval* formals) {
+  for (int i = 0, j = 0; i < formals->count; i++) {
+    if (lval_is_rest(formals->cell[i])) { continue; }
+    if (lsimp_formal(formals, formals->cell[i]) != j++) { return 0; }
+  }
+  return 1;
+}
+
+/* Print the calls pipeline x was fused from */
+void lpipe_print(lval* x) {
+  lval* stages = x->cell[1];
+  int at = 2;
+  for (int k = 0; k < stages->count; k++) {
+    lstage* st = lstage_named(stages->cell[k]->sym);
+    printf("(%s ", st->name);
+    for (int j = 0; j < st->args; j++) { lval_print(x->cell[at++]); putchar(' '); }
+  }
+  lval_print(x->cell[at]);
+  for (int k = 0; k < stages->count; k++) { putchar(')'); }
+}
+
+/* Print each pipeline in simplified code x, innermost stage first */
+void lsimp_explain(lval* x) {
+  if (x->type != LVAL_SEXPR) { return; }
+  if (lval_is_pipe(x)) {
+    printf("fused ");
+    for (int k = x->cell[1]->count - 1; k >= 0; k--) {
+      printf("%s%s", x->cell[1]->cell[k]->sym, k ? " -> " : ": ");
+    }
+    lpipe_print(x);
+    putchar('\n');
+  }
+  for (int i = 0; i < x->count; i++) { lsimp_explain(x->cell[i]); }
+}
+
+/* Simplify a top level expression, or one passed to eval */
+lval* lval_simplify_expr(lenv* e, lval* v) {
+  lsimp s = { e, NULL, 0 };
+  v = lval_simplify(&s, v);
+  if (!e->par) { lval_resolve(e, v, NULL); }
+  lval_infer(v);
+  if (hoagie_explain) { lsimp_explain(v); }
+  if (hoagie_dump_simplified) { lval_println(v); }
+  return v;
+}
+
+/*
+ * Simplify a copy of a lambda body made in e, which is always returned
+ * as an S-Expression with its symbols resolved. When called, the
+ * formals shadow everything in e.
+ */
+lval* lval_simplify_body(lenv* e, lval* formals, lval* body) {
+  lscope scope = { formals, NULL };
+  lsimp s = { e, &scope, 0 };
+  lval* x = lval_copy(body);
+  x->type = LVAL_SEXPR;
+  x = lval_simplify(&s, x);
+  if (x->type != LVAL_SEXPR) { x = lval_add(lval_sexpr(), x); }
+  if (lval_formals_distinct(formals)) { lval_resolve(s.env, x, &scope); }
+  lval_infer(x);
+  if (hoagie_explain) { lsimp_explain(x); }
+  
+  if (hoagie_dump_simplified) {
+    printf("(\\ "); lval_print(formals);
+    putchar(' '); lval_print(x); printf(")\n");
+  }
+  return x;
+}
+
+/* Does replacing old with v break an assumption made by simplifying */
+int lsimp_assumed(lval* old, lval* v) {
+  if (v->type == LVAL_FUN && lval_is_form(v->builtin)) { return 1; }
+  if (old->type != LVAL_FUN) { return 0; }
+  if (!old->builtin) { return old->chunk->inlined; }
+  return !(v->type == LVAL_FUN && v->builtin == old->builtin);
+}
+
+/*
+ * Simplify the body of f again if bindings it was simplified under have
+ * been redefined since, when it is about to run or be inlined. Copies of
+ * f share the chunk, which points the others at the one made in its
+ * place, so the body is only simplified again once.
+ */
+void lsimp_refresh(lval* f) {
+  lchunk* c = f->chunk;
+  if (c->epoch == lsimp_epoch && !c->fresh) { return; }
+  
+  while (c->fresh) { c = c->fresh; }
+  if (c->epoch != lsimp_epoch) {
+    /* A lambda calling itself sees its old body, which is not inlined */
+    c->epoch = lsimp_epoch;
+    c->fresh = lval_compile_body(f->env, lval_copy(c->formals), lval_copy(c->source));
+    c = c->fresh;
+  }
+  
+  lchunk_retain(c);
+  lchunk_release(f->chunk);
+  f->chunk = c;
+  f->formals = c->formals;
+  f->body = c->source;
+}
+
+/* Virtual Machine */
+
+/*
+ * Arithmetic on numbers straight off the stack, skipping the argument
+ * list. Takes ownership of them, and like the builtins reuses the first
+ * for the result rather than allocating another.
+ */
+lval* lvm_arith(lbuiltin f, lval** args, int n) {
+  long x = 0;
+  int status = LARITH_OK;
+  #define LARITH_DISPATCH(name, op) \
+    if (f == builtin_##name) { status = larith_##name##_n(&x, args, n); }
+  LARITH_OPS(LARITH_DISPATCH)
+  #undef LARITH_DISPATCH
+  for (int i = 1; i < n; i++) { lval_del(args[i]); }
+  if (status != LARITH_OK) {
+    lval_del(args[0]);
+    return larith_err(status);
+  }
+  args[0]->num = x;
+  return args[0];
+}
+
+int lvm_is_arith(lbuiltin f) {
+  #define LARITH_IS(name, op) if (f == builtin_##name) { return 1; }
+  LARITH_OPS(LARITH_IS)
+  #undef LARITH_IS
+  return 0;
+}
+
+/* Apply a builtin to n evaluated arguments, the first error among them wins */
+lval* lvm_apply(lenv* e, lbuiltin f, lval** args, int n) {
+
+  for (int i = 0; i < n; i++) {
+    if (args[i]->type == LVAL_ERR) {
+      lval* err = args[i];
+      for (int j = 0; j < n; j++) { if (j != i) { lval_del(args[j]); } }
+      return err;
+    }
+  }
+
+  /* Fast path for arithmetic on numbers */
+  if (lvm_is_arith(f) && n > 0) {
+    int nums = 1;
+    for (int i = 0; i < n; i++) { nums &= args[i]->type == LVAL_NUM; }
+    if (nums) { return lvm_arith(f, args, n); }
+  }
+  
+  /* And for comparing two numbers, reusing the first for the result */
+  if (n == 2 && args[0]->type == LVAL_NUM && args[1]->type == LVAL_NUM
+      && lval_is_compare(f)) {
+    larith_step(f)(&args[0]->num, args[1]->num);
+    lval_del(args[1]);
+    return args[0];
+  }
+
+  /* Otherwise hand the arguments to the builtin as an S-Expression */
+  lval* a = lval_sexpr();
+  a->count = n;
+  a->cell = malloc(sizeof(lval*) * n);
+  memcpy(a->cell, args, sizeof(lval*) * n);
+  return f(e, a);
+}
+
+lval* lvm_run(lenv* e, lchunk* c);
+
+/* Call a lambda in a new frame, taking ownership of it and the arguments */
+lval* lvm_call_lambda(lenv* e, lval* f, lval** args, int n) {
+  lenv* frame = lenv_frame(e, f, NULL);
+  lval* err = lval_bind(frame, f, args, n);
+  if (err) {
+    lenv_del(frame);
+    lval_del(f);
+    return err;
+  }
+  
+  lval* result = lvm_run(frame, f->chunk);
+  lenv_del(frame);
+  lval_del(f);
+  return result;
+}
+
+/* Apply the function at base[0] to the n arguments above it */
+lval* lvm_call(lenv* e, lval** base, int n) {
+
+  lval* f = base[0];
+  if (f->type == LVAL_FUN && f->builtin) {
+    lval* result = lvm_apply(e, f->builtin, base+1, n);
+    lval_del(f);
+    return result;
+  }
+
+  /* Like the tree evaluator, the first error in the expression wins */
+  for (int i = 0; i <= n; i++) {
+    if (base[i]->type == LVAL_ERR) {
+      lval* err = base[i];
+      for (int j = 0; j <= n; j++) { if (j != i) { lval_del(base[j]); } }
+      return err;
+    }
+  }
+
+  if (f->type == LVAL_FUN) { return lvm_call_lambda(e, f, base+1, n); }
+
+  lval* err = lval_err(
+    "S-Expression starts with incorrect type. "
+    "Got %s, Expected %s.",
+    ltype_name(f->type), ltype_name(LVAL_FUN));
+  for (int i = 0; i <= n; i++) { lval_del(base[i]); }
+  return err;
+}
+
+/* A tail call to a lambda, waiting for lvm_run to make it */
+lval* lvm_tail_fn = NULL;
+lval** lvm_tail_args = NULL;
+int lvm_tail_count = 0;
+int lvm_tail_size = 0;
+
+/*
+ * Like lvm_call, except that calls to lambdas are left pending and
+ * NULL returned, so lvm_run can make them without growing the C stack.
+ */
+lval* lvm_tailcall(lenv* e, lval** base, int n) {
+  for (int i = 0; i <= n; i++) {
+    if (base[i]->type == LVAL_ERR) { return lvm_call(e, base, n); }
+  }
+  if (base[0]->type != LVAL_FUN || base[0]->builtin) { return lvm_call(e, base, n); }
+
+  if (n > lvm_tail_size) {
+    lvm_tail_size = n;
+    lvm_tail_args = realloc(lvm_tail_args, sizeof(lval*) * n);
+  }
+  lvm_tail_fn = base[0];
+  memcpy(lvm_tail_args, base+1, sizeof(lval*) * n);
+  lvm_tail_count = n;
+  return NULL;
+}
+
+/* What a conditional jump does with the condition on top of the stack */
+enum { LVM_NEXT, LVM_JUMP, LVM_KEEP, LVM_FAIL };
+
+/*
+ * Test the condition at top for jump op. It is freed unless it is kept
+ * as the value of the form, or replaced by the error the form gives.
+ */
+int lvm_branch(lval** top, int op) {
+  lbuiltin form = op == OP_IF ? builtin_if : op == OP_COND ? builtin_cond
+    : op == OP_AND ? builtin_and : op == OP_OR ? builtin_or : builtin_while;
+  lval* err = lval_test(*top, lform_name(form));
+  if (err) { *top = err; return LVM_FAIL; }
+  
+  int truth = (*top)->num != 0;
+  if (op == OP_AND || op == OP_OR) {
+    if (truth == (op == OP_OR)) { return LVM_KEEP; }
+    lval_del(*top);
+    return LVM_NEXT;
+  }
+  lval_del(*top);
+  return truth ? LVM_NEXT : LVM_JUMP;
+}
+
+/* Pop the value of a loop body at top, returning 1 if it is an error kept instead */
+int lvm_drop(lval** top) {
+  if ((*top)->type == LVAL_ERR) { return 1; }
+  lval_del(*top);
+  return 0;
+}
+
+/* Enter a loop frame binding var in e, pushing the count at sp */
+lenv* lvm_enter(lenv* e, lval** sp, lval* var) {
+  *sp = lval_num(0);
+  return lenv_loop(e, var);
+}
+
+/*
+ * Go round loop op again in loop frame e, with the count at sp[-1]. A
+ * source of the wrong type fails, pushing the error at sp.
+ */
+int lvm_iterate(lenv* e, lval** sp, int op) {
+  lval* src = sp[-2];
+  lval* n = sp[-1];
+  if (n->num == 0) {
+    lval* err = lval_source(src, op == OP_DOTIMES ? builtin_dotimes : builtin_for_each);
+    if (err) { *sp = err; return LVM_FAIL; }
+  }
+  if (!lenv_iterate(e, src, n->num)) { return LVM_JUMP; }
+  n->num++;
+  return LVM_NEXT;
+}
+
+/* Leave loop frame e, moving the value at sp[-1] down over the count and source */
+lenv* lvm_leave(lenv* e, lval** sp) {
+  e = lenv_unloop(e, sp[-3], sp[-2]->num);
+  lval_del(sp[-3]);
+  lval_del(sp[-2]);
+  sp[-3] = sp[-1];
+  return e;
+}
+
+/* JIT */
+
+/*
+ * A template JIT for x86-64. Each bytecode instruction is replaced by
+ * a fixed sequence of machine code that calls the same helpers the VM
+ * uses, so the only savings are dispatch and operand decoding, plus
+ * two argument +, - and * on numbers which are done inline. Anything
+ * the JIT does not understand leaves the chunk with the interpreter.
+ */
+
+int hoagie_jit = 1;
+int hoagie_jit_threshold = 100;
+
+#ifdef HOAGIE_JIT
+
+typedef lval*(*ljit_fn)(lenv*, lval**, lval**);
+
+/*
+ * Executable code is allocated out of a single mapping, first fit from
+ * the free spans in it. These are kept in order, so a span given back
+ * joins its neighbours. Chunks and traces give their code back when
+ * deleted, so code replaced after a redefinition, or given up on, does
+ * not fill the region. Each block starts with its size, and code which
+ * will not fit is counted in --stats and left to the interpreter.
+ */
+#define LJIT_REGION_SIZE (4 * 1024 * 1024)
+#define LJIT_HEADER 16
+
+typedef struct {
+  int at;
+  int size;
+} ljit_span;
+
+unsigned char* ljit_region = NULL;
+ljit_span* ljit_spans = NULL;
+int ljit_nspans = 0;
+
+/* Look up a function, or return NULL if it is exactly the builtin given */
+lval* ljit_get_fn(lenv* e, lval* k, lbuiltin expect) {
+  lval* f = lenv_peek(e, k);
+  if (f && f->type == LVAL_FUN && f->builtin == expect) { return NULL; }
+  return lenv_get(e, k);
+}
+
+typedef struct {
+  int count;
+  unsigned char* code;
+} ljit;
+
+void ljit_byte(ljit* j, int b) {
+  j->code = realloc(j->code, j->count + 1);
+  j->code[j->count++] = b;
+}
+
+void ljit_bytes(ljit* j, int n, const char* bytes) {
+  for (int i = 0; i < n; i++) { ljit_byte(j, (unsigned char)bytes[i]); }
+}
+
+void ljit_u32(ljit* j, unsigned int x) {
+  for (int i = 0; i < 4; i++) { ljit_byte(j, (x >> (i * 8)) & 0xFF); }
+}
+
+void ljit_u64(ljit* j, unsigned long long x) {
+  for (int i = 0; i < 8; i++) { ljit_byte(j, (x >> (i * 8)) & 0xFF); }
+}
+
+/* mov rax, imm64; call rax */
+void ljit_call(ljit* j, void* fn) {
+  ljit_bytes(j, 2, "\x48\xB8");
+  ljit_u64(j, (unsigned long long)(size_t)fn);
+  ljit_bytes(j, 2, "\xFF\xD0");
+}
+
+/* Emit a 32-bit jump and return the offset of its displacement */
+int ljit_jump(ljit* j, const char* op, int n) {
+  ljit_bytes(j, n, op);
+  ljit_u32(j, 0);
+  return j->count - 4;
+}
+
+void ljit_patch(ljit* j, int at, int target) {
+  unsigned int rel = target - (at + 4);
+  for (int i = 0; i < 4; i++) { j->code[at+i] = (rel >> (i * 8)) & 0xFF; }
+}
+
+/*
+ * Register use in generated code:
+ *   rbx = environment, r14 = value stack pointer, r15 = constants
+ */
+
+/* mov [r14+0], rax; add r14, 8 */
+void ljit_push_rax(ljit* j) {
+  ljit_bytes(j, 3, "\x49\x89\x86"); ljit_u32(j, 0);
+  ljit_bytes(j, 3, "\x49\x81\xC6"); ljit_u32(j, 8);
+}
+
+/* mov rsi, [r15 + index*8] */
+void ljit_load_const_rsi(ljit* j, int index) {
+  ljit_bytes(j, 3, "\x49\x8B\xB7"); ljit_u32(j, index * 8);
+}
+
+/* Generic call: sub r14, (n+1)*8; call(rbx, r14, n); push result */
+void ljit_emit_call(ljit* j, int n, void* call) {
+  ljit_bytes(j, 3, "\x49\x81\xEE"); ljit_u32(j, (n + 1) * 8);
+  ljit_bytes(j, 3, "\x48\x89\xDF");
+  ljit_bytes(j, 3, "\x4C\x89\xF6");
+  ljit_byte(j, 0xBA); ljit_u32(j, n);
+  ljit_call(j, call);
+  ljit_push_rax(j);
+}
+
+/* Builtin which a two argument call may inline, or NULL */
+lbuiltin ljit_inline_op(lval* sym) {
+  if (strcmp(sym->sym, "+") == 0) { return builtin_add; }
+  if (strcmp(sym->sym, "-") == 0) { return builtin_sub; }
+  if (strcmp(sym->sym, "*") == 0) { return builtin_mul; }
+  return NULL;
+}
+
+/* Two argument arithmetic, assuming the function slot is NULL */
+void ljit_emit_arith(ljit* j, lbuiltin op, int sym_index, void* call) {
+
+  int type = offsetof(lval, type);
+  int num = offsetof(lval, num);
+
+  /* Function slot is NULL only if the symbol is still bound to op */
+  ljit_bytes(j, 3, "\x49\x8B\x86"); ljit_u32(j, -24);
+  ljit_bytes(j, 3, "\x48\x85\xC0");
+  int generic = ljit_jump(j, "\x0F\x85", 2);
+
+  /* rdi = first argument, rsi = second, both must be numbers */
+  ljit_bytes(j, 3, "\x49\x8B\xBE"); ljit_u32(j, -16);
+  ljit_bytes(j, 3, "\x49\x8B\xB6"); ljit_u32(j, -8);
+  ljit_bytes(j, 2, "\x81\xBF"); ljit_u32(j, type); ljit_u32(j, LVAL_NUM);
+  int slow_a = ljit_jump(j, "\x0F\x85", 2);
+  ljit_bytes(j, 2, "\x81\xBE"); ljit_u32(j, type); ljit_u32(j, LVAL_NUM);
+  int slow_b = ljit_jump(j, "\x0F\x85", 2);
+
+  /* rax = a op b, leaving the interpreter to deal with overflow */
+  ljit_bytes(j, 3, "\x48\x8B\x87"); ljit_u32(j, num);
+  if (op == builtin_add) { ljit_bytes(j, 3, "\x48\x03\x86"); }
+  if (op == builtin_sub) { ljit_bytes(j, 3, "\x48\x2B\x86"); }
+  if (op == builtin_mul) { ljit_bytes(j, 4, "\x48\x0F\xAF\x86"); }
+  ljit_u32(j, num);
+  int slow_o = ljit_jump(j, "\x0F\x80", 2);
+
+  /* Store into the first argument, free the second, move it down */
+  ljit_bytes(j, 3, "\x48\x89\x87"); ljit_u32(j, num);
+  ljit_bytes(j, 3, "\x48\x89\xF7");
+  ljit_call(j, lval_del);
+  ljit_bytes(j, 3, "\x49\x8B\x86"); ljit_u32(j, -16);
+  ljit_bytes(j, 3, "\x49\x89\x86"); ljit_u32(j, -24);
+  ljit_bytes(j, 3, "\x49\x81\xEE"); ljit_u32(j, 16);
+  int done = ljit_jump(j, "\xE9", 1);
+
+  /* Slow path: fetch the function after all and make a normal call */
+  ljit_patch(j, slow_a, j->count);
+  ljit_patch(j, slow_b, j->count);
+  ljit_patch(j, slow_o, j->count);
+  ljit_bytes(j, 3, "\x48\x89\xDF");
+  ljit_load_const_rsi(j, sym_index);
+  ljit_call(j, lenv_get);
+  ljit_bytes(j, 3, "\x49\x89\x86"); ljit_u32(j, -24);
+
+  ljit_patch(j, generic, j->count);
+  ljit_emit_call(j, 2, call);
+  ljit_patch(j, done, j->count);
+}
+
+/* Copy finished code into the executable region */
+void* ljit_install(ljit* j) {
+  if (!ljit_region) {
+    ljit_region = mmap(NULL, LJIT_REGION_SIZE, PROT_READ | PROT_EXEC,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ljit_region == MAP_FAILED) {
+      ljit_region = NULL;
+    } else {
+      ljit_spans = malloc(sizeof(ljit_span));
+      ljit_spans[0].at = 0;
+      ljit_spans[0].size = LJIT_REGION_SIZE;
+      ljit_nspans = 1;
+    }
+  }
+  
+  int size = (LJIT_HEADER + j->count + 15) & ~15;
+  int i = 0;
+  while (i < ljit_nspans && ljit_spans[i].size < size) { i++; }
+  if (i == ljit_nspans) {
+    hoagie_stats.jit_refused++;
+    free(j->code);
+    return NULL;
+  }
+  
+  unsigned char* block = ljit_region + ljit_spans[i].at;
+  ljit_spans[i].at += size;
+  ljit_spans[i].size -= size;
+  if (ljit_spans[i].size == 0) {
+    ljit_nspans--;
+    memmove(&ljit_spans[i], &ljit_spans[i+1],
+      sizeof(ljit_span) * (ljit_nspans - i));
+  }
+  
+  mprotect(ljit_region, LJIT_REGION_SIZE, PROT_READ | PROT_WRITE);
+  memcpy(block, &size, sizeof(int));
+  memcpy(block + LJIT_HEADER, j->code, j->count);
+  mprotect(ljit_region, LJIT_REGION_SIZE, PROT_READ | PROT_EXEC);
+  free(j->code);
+  return block + LJIT_HEADER;
+}
+
+/* Give code from ljit_install back to the region */
+void ljit_free(void* code) {
+  if (!code) { return; }
+  unsigned char* block = (unsigned char*)code - LJIT_HEADER;
+  int at = block - ljit_region;
+  int size;
+  memcpy(&size, block, sizeof(int));
+  
+  int i = 0;
+  while (i < ljit_nspans && ljit_spans[i].at < at) { i++; }
+  int before = i > 0 && ljit_spans[i-1].at + ljit_spans[i-1].size == at;
+  int after = i < ljit_nspans && at + size == ljit_spans[i].at;
+  
+  if (before && after) {
+    ljit_spans[i-1].size += size + ljit_spans[i].size;
+    ljit_nspans--;
+    memmove(&ljit_spans[i], &ljit_spans[i+1],
+      sizeof(ljit_span) * (ljit_nspans - i));
+  } else if (before) {
+    ljit_spans[i-1].size += size;
+  } else if (after) {
+    ljit_spans[i].at = at;
+    ljit_spans[i].size += size;
+  } else {
+    ljit_spans = realloc(ljit_spans, sizeof(ljit_span) * (ljit_nspans + 1));
+    memmove(&ljit_spans[i+1], &ljit_spans[i],
+      sizeof(ljit_span) * (ljit_nspans - i));
+    ljit_spans[i].at = at;
+    ljit_spans[i].size = size;
+    ljit_nspans++;
+  }
+}
+
+int lchunk_jit(lchunk* c) {
+
+  c->jit_failed = 1;
+
+  /*
+   * Find which instruction produced each function slot of a call. Code
+   * after a JUMP or RET is only reached by jumping to it, from where
+   * the stack depth is already known.
+   */
+  int* inline_op = calloc(c->count, sizeof(int));
+  int* producer = malloc(sizeof(int) * (c->max_depth + 1));
+  int* depth_at = malloc(sizeof(int) * (c->count / 3 + 1));
+  for (int i = 0; i <= c->count / 3; i++) { depth_at[i] = -1; }
+  int depth = 0;
+  for (int i = 0; i < c->count; i += 3) {
+    int arg = c->code[i+1] | (c->code[i+2] << 8);
+    if (depth_at[i/3] >= 0) { depth = depth_at[i/3]; }
+    switch (c->code[i]) {
+      case OP_CONST:
+      case OP_GET: producer[depth++] = i; break;
+      case OP_CALL:
+      case OP_TAILCALL:
+        depth -= arg;
+        int p = producer[depth-1];
+        if (arg == 2 && c->code[p] == OP_GET) {
+          int k = c->code[p+1] | (c->code[p+2] << 8);
+          if (ljit_inline_op(c->consts[k])) { inline_op[p] = 1; inline_op[i] = k + 1; }
+        }
+        producer[depth-1] = i;
+        break;
+      case OP_RET: depth--; break;
+      case OP_JUMP: depth_at[arg/3] = depth; break;
+      case OP_IF:
+      case OP_COND: depth_at[arg/3] = --depth; break;
+      case OP_AND:
+      case OP_OR: depth_at[arg/3] = depth--; break;
+      case OP_WHILE:
+        depth_at[arg/3] = depth;
+        depth_at[arg/3-1] = --depth;
+        break;
+      case OP_DROP: depth_at[arg/3] = depth--; break;
+      case OP_ENTER: producer[depth++] = i; break;
+      case OP_DOTIMES:
+      case OP_FOREACH:
+        depth_at[arg/3] = depth + 1;
+        depth_at[arg/3-1] = depth;
+        break;
+      case OP_LEAVE: depth -= 2; break;
+      default:
+        free(inline_op); free(producer); free(depth_at);
+        return 0;
+    }
+  }
+  free(producer);
+  free(depth_at);
+
+  ljit j = { 0, NULL };
+  
+  /* Where each instruction starts, and jumps waiting to be pointed there */
+  int* native_at = malloc(sizeof(int) * (c->count / 3 + 1));
+  int* jumps = malloc(sizeof(int) * c->count);
+  int* targets = malloc(sizeof(int) * c->count);
+  int njumps = 0;
+
+  /* Prologue: save callee saved registers, keep the stack aligned */
+  ljit_bytes(&j, 6, "\x55\x53\x41\x56\x41\x57");
+  ljit_bytes(&j, 4, "\x48\x83\xEC\x08");
+  ljit_bytes(&j, 3, "\x48\x89\xFB");
+  ljit_bytes(&j, 3, "\x49\x89\xF6");
+  ljit_bytes(&j, 3, "\x49\x89\xD7");
+
+  for (int i = 0; i < c->count; i += 3) {
+    int arg = c->code[i+1] | (c->code[i+2] << 8);
+    native_at[i/3] = j.count;
+    switch (c->code[i]) {
+      case OP_CONST:
+        ljit_bytes(&j, 3, "\x49\x8B\xBF"); ljit_u32(&j, arg * 8);
+        ljit_call(&j, lval_copy);
+        ljit_push_rax(&j);
+        break;
+      case OP_GET:
+        ljit_bytes(&j, 3, "\x48\x89\xDF");
+        ljit_load_const_rsi(&j, arg);
+        if (inline_op[i]) {
+          ljit_byte(&j, 0x48); ljit_byte(&j, 0xBA);
+          ljit_u64(&j, (unsigned long long)(size_t)ljit_inline_op(c->consts[arg]));
+          ljit_call(&j, ljit_get_fn);
+        } else {
+          ljit_call(&j, lenv_get);
+        }
+        ljit_push_rax(&j);
+        break;
+      case OP_CALL:
+      case OP_TAILCALL: {
+        void* call = c->code[i] == OP_CALL ? (void*)lvm_call : (void*)lvm_tailcall;
+        if (inline_op[i]) {
+          int k = inline_op[i] - 1;
+          ljit_emit_arith(&j, ljit_inline_op(c->consts[k]), k, call);
+        } else {
+          ljit_emit_call(&j, arg, call);
+        }
+      } break;
+      case OP_RET:
+        /* sub r14, 8; mov rax, [r14]; epilogue */
+        ljit_bytes(&j, 3, "\x49\x81\xEE"); ljit_u32(&j, 8);
+        ljit_bytes(&j, 3, "\x49\x8B\x86"); ljit_u32(&j, 0);
+        ljit_bytes(&j, 4, "\x48\x83\xC4\x08");
+        ljit_bytes(&j, 6, "\x41\x5F\x41\x5E\x5B\x5D");
+        ljit_byte(&j, 0xC3);
+        break;
+      case OP_JUMP:
+        jumps[njumps] = ljit_jump(&j, "\xE9", 1);
+        targets[njumps++] = arg;
+        break;
+      case OP_IF:
+      case OP_COND:
+      case OP_AND:
+      case OP_OR: {
+        /* lea rdi, [r14-8]; mov esi, op; call lvm_branch */
+        ljit_bytes(&j, 4, "\x49\x8D\x7E\xF8");
+        ljit_byte(&j, 0xBE); ljit_u32(&j, c->code[i]);
+        ljit_call(&j, lvm_branch);
+
+        /* test eax, eax; jz next; cmp eax, LVM_KEEP; je keep; ja fail */
+        ljit_bytes(&j, 2, "\x85\xC0");
+        int next = ljit_jump(&j, "\x0F\x84", 2);
+        ljit_bytes(&j, 2, "\x83\xF8"); ljit_byte(&j, LVM_KEEP);
+        jumps[njumps] = ljit_jump(&j, "\x0F\x84", 2);
+        targets[njumps++] = arg;
+        jumps[njumps] = ljit_jump(&j, "\x0F\x87", 2);
+        targets[njumps++] = arg - 3;
+
+        /* LVM_JUMP: sub r14, 8; jmp target */
+        ljit_bytes(&j, 3, "\x49\x81\xEE"); ljit_u32(&j, 8);
+        jumps[njumps] = ljit_jump(&j, "\xE9", 1);
+        targets[njumps++] = arg;
+
+        /* LVM_NEXT: sub r14, 8 */
+        ljit_patch(&j, next, j.count);
+        ljit_bytes(&j, 3, "\x49\x81\xEE"); ljit_u32(&j, 8);
+      } break;
+      case OP_WHILE: {
+        /* lea rdi, [r14-8]; mov esi, op; call lvm_branch */
+        ljit_bytes(&j, 4, "\x49\x8D\x7E\xF8");
+        ljit_byte(&j, 0xBE); ljit_u32(&j, OP_WHILE);
+        ljit_call(&j, lvm_branch);
+
+        /* test eax, eax; jz next; cmp eax, LVM_JUMP; jne exit */
+        ljit_bytes(&j, 2, "\x85\xC0");
+        int next = ljit_jump(&j, "\x0F\x84", 2);
+        ljit_bytes(&j, 2, "\x83\xF8"); ljit_byte(&j, LVM_JUMP);
+        jumps[njumps] = ljit_jump(&j, "\x0F\x85", 2);
+        targets[njumps++] = arg;
+
+        /* LVM_JUMP: sub r14, 8; jmp done */
+        ljit_bytes(&j, 3, "\x49\x81\xEE"); ljit_u32(&j, 8);
+        jumps[njumps] = ljit_jump(&j, "\xE9", 1);
+        targets[njumps++] = arg - 3;
+
+        /* LVM_NEXT: sub r14, 8 */
+        ljit_patch(&j, next, j.count);
+        ljit_bytes(&j, 3, "\x49\x81\xEE"); ljit_u32(&j, 8);
+      } break;
+      case OP_DROP:
+        /* lea rdi, [r14-8]; call lvm_drop; test eax, eax; jnz exit; sub r14, 8 */
+        ljit_bytes(&j, 4, "\x49\x8D\x7E\xF8");
+        ljit_call(&j, lvm_drop);
+        ljit_bytes(&j, 2, "\x85\xC0");
+        jumps[njumps] = ljit_jump(&j, "\x0F\x85", 2);
+        targets[njumps++] = arg;
+        ljit_bytes(&j, 3, "\x49\x81\xEE"); ljit_u32(&j, 8);
+        break;
+      case OP_ENTER:
+        /* rbx = lvm_enter(rbx, r14, [r15 + arg*8]); add r14, 8 */
+        ljit_bytes(&j, 3, "\x48\x89\xDF");
+        ljit_bytes(&j, 3, "\x4C\x89\xF6");
+        ljit_bytes(&j, 3, "\x49\x8B\x97"); ljit_u32(&j, arg * 8);
+        ljit_call(&j, lvm_enter);
+        ljit_bytes(&j, 3, "\x48\x89\xC3");
+        ljit_bytes(&j, 3, "\x49\x81\xC6"); ljit_u32(&j, 8);
+        break;
+      case OP_DOTIMES:
+      case OP_FOREACH: {
+        /* lvm_iterate(rbx, r14, op) */
+        ljit_bytes(&j, 3, "\x48\x89\xDF");
+        ljit_bytes(&j, 3, "\x4C\x89\xF6");
+        ljit_byte(&j, 0xBA); ljit_u32(&j, c->code[i]);
+        ljit_call(&j, lvm_iterate);
+
+        /* test eax, eax; jz next; cmp eax, LVM_JUMP; je done */
+        ljit_bytes(&j, 2, "\x85\xC0");
+        int next = ljit_jump(&j, "\x0F\x84", 2);
+        ljit_bytes(&j, 2, "\x83\xF8"); ljit_byte(&j, LVM_JUMP);
+        jumps[njumps] = ljit_jump(&j, "\x0F\x84", 2);
+        targets[njumps++] = arg - 3;
+
+        /* LVM_FAIL: add r14, 8; jmp exit */
+        ljit_bytes(&j, 3, "\x49\x81\xC6"); ljit_u32(&j, 8);
+        jumps[njumps] = ljit_jump(&j, "\xE9", 1);
+        targets[njumps++] = arg;
+        ljit_patch(&j, next, j.count);
+      } break;
+      case OP_LEAVE:
+        /* rbx = lvm_leave(rbx, r14); sub r14, 16 */
+        ljit_bytes(&j, 3, "\x48\x89\xDF");
+        ljit_bytes(&j, 3, "\x4C\x89\xF6");
+        ljit_call(&j, lvm_leave);
+        ljit_bytes(&j, 3, "\x48\x89\xC3");
+        ljit_bytes(&j, 3, "\x49\x81\xEE"); ljit_u32(&j, 16);
+        break;
+    }
+  }
+  free(inline_op);
+
+  for (int i = 0; i < njumps; i++) {
+    ljit_patch(&j, jumps[i], native_at[targets[i]/3]);
+  }
+  free(native_at);
+  free(jumps);
+  free(targets);
+
+  c->native = ljit_install(&j);
+  if (!c->native) { return 0; }
+  c->jit_failed = 0;
+  return 1;
+}
+
+#else
+
+int lchunk_jit(lchunk* c) {
+  c->jit_failed = 1;
+  return 0;
+}
+
+#endif
+
+#if defined(__GNUC__) && !defined(HOAGIE_NO_COMPUTED_GOTO)
+#define LVM_COMPUTED_GOTO
+#endif
+
+/* Run a chunk from ip, taking ownership of the stack given */
+lval* lvm_exec(lenv* e, lchunk* c, lval** stack, lval** sp, unsigned char* ip) {
+
+  int arg;
+  lval* result;
+
+  #define READ_ARG() (arg = ip[1] | (ip[2] << 8), ip += 3)
+
+  #ifdef LVM_COMPUTED_GOTO
+  static void* dispatch[] = {
+    &&op_const, &&op_get, &&op_call, &&op_tailcall, &&op_ret,
+    &&op_jump, &&op_if, &&op_cond, &&op_and, &&op_or,
+    &&op_while, &&op_drop, &&op_enter, &&op_dotimes, &&op_foreach, &&op_leave };
+  #define CASE(op) op_##op:
+  #define NEXT() goto *dispatch[*ip]
+  NEXT();
+  #else
+  #define CASE(op) case OP_##op:
+  #define NEXT() continue
+  for (;;) switch (*ip) {
+  #endif
+
+  CASE(const)
+    READ_ARG();
+    *sp++ = lval_copy(c->consts[arg]);
+    NEXT();
+
+  CASE(get)
+    READ_ARG();
+    *sp++ = lenv_get(e, c->consts[arg]);
+    NEXT();
+
+  CASE(call)
+    READ_ARG();
+    sp -= arg + 1;
+    *sp = lvm_call(e, sp, arg);
+    sp++;
+    NEXT();
+
+  CASE(tailcall)
+    READ_ARG();
+    sp -= arg + 1;
+    *sp = lvm_tailcall(e, sp, arg);
+    sp++;
+    NEXT();
+
+  CASE(ret)
+    result = *--sp;
+    free(stack);
+    return result;
+
+  CASE(jump)
+    READ_ARG();
+    ip = c->code + arg;
+    NEXT();
+
+  CASE(if)
+  CASE(cond)
+  CASE(and)
+  CASE(or)
+    READ_ARG();
+    switch (lvm_branch(sp - 1, ip[-3])) {
+      case LVM_NEXT: sp--; break;
+      case LVM_JUMP: sp--; ip = c->code + arg; break;
+      case LVM_KEEP: ip = c->code + arg; break;
+      case LVM_FAIL: ip = c->code + arg - 3; break;
+    }
+    NEXT();
+
+  CASE(while)
+    READ_ARG();
+    switch (lvm_branch(sp - 1, OP_WHILE)) {
+      case LVM_NEXT: sp--; break;
+      case LVM_JUMP: sp--; ip = c->code + arg - 3; break;
+      default: ip = c->code + arg; break;
+    }
+    NEXT();
+
+  CASE(drop)
+    READ_ARG();
+    if (lvm_drop(sp - 1)) { ip = c->code + arg; } else { sp--; }
+    NEXT();
+
+  CASE(enter)
+    READ_ARG();
+    e = lvm_enter(e, sp++, c->consts[arg]);
+    NEXT();
+
+  CASE(dotimes)
+  CASE(foreach)
+    READ_ARG();
+    switch (lvm_iterate(e, sp, ip[-3])) {
+      case LVM_NEXT: break;
+      case LVM_JUMP: ip = c->code + arg - 3; break;
+      default: sp++; ip = c->code + arg; break;
+    }
+    NEXT();
+
+  CASE(leave)
+    READ_ARG();
+    e = lvm_leave(e, sp);
+    sp -= 2;
+    NEXT();
+
+  #ifndef LVM_COMPUTED_GOTO
+  default:
+    free(stack);
+    return lval_err("Invalid opcode %i.", *ip);
+  }
+  #endif
+
+  #undef READ_ARG
+  #undef CASE
+  #undef NEXT
+}
+
+/* Tracing */
+
+/*
+ * Once a chunk is hot, one run of it is recorded: alongside the real
+ * values the recorder builds a linear IR, guarding on the types and
+ * builtins it saw. Numbers flowing between arithmetic and comparison
+ * builtins stay unboxed in slots and are only turned back into lvals
+ * where they escape (a generic call, the result, or a side exit).
+ * When a guard fails the values on the VM stack at that instruction
+ * are rebuilt and the interpreter carries on from there.
+ *
+ * Branches are recorded as guards on the way the condition went, with
+ * the branch itself as their side exit. A tail call back to the chunk
+ * being recorded ends the trace in a loop, which binds the arguments in
+ * the call frame and goes round again, so a self recursive walker runs
+ * in the trace until it reaches its base case.
+ */
+
+int hoagie_trace = 1;
+int hoagie_trace_threshold = 50;
+int hoagie_dump_trace = 0;
+
+#ifdef HOAGIE_JIT
+
+enum { IR_KNUM, IR_KVAL, IR_GET, IR_GET_NUM, IR_GET_FN,
+       IR_FN, IR_ARITH, IR_CMP, IR_CALL, IR_TAILCALL, IR_RET, IR_NOP,
+       IR_GUARD, IR_LOOP };
+
+char* lir_name(int op) {
+  switch(op) {
+    case IR_KNUM: return "knum";
+    case IR_KVAL: return "kval";
+    case IR_GET: return "get";
+    case IR_GET_NUM: return "get.num";
+    case IR_GET_FN: return "get.fn";
+    case IR_FN: return "fn";
+    case IR_ARITH: return "arith";
+    case IR_CMP: return "cmp";
+    case IR_CALL: return "call";
+    case IR_TAILCALL: return "tailcall";
+    case IR_RET: return "ret";
+    case IR_NOP: return "nop";
+    case IR_GUARD: return "guard";
+    case IR_LOOP: return "loop";
+    default: return "unknown";
+  }
+}
+
+typedef struct {
+  int op;
+  int pc;
+  long num;
+  int k;
+  lbuiltin fn;
+  int a, b;
+  int n;
+  int* args;
+  int exit;
+} lir;
+
+/* Everything needed to resume the interpreter when a guard fails */
+typedef struct {
+  int pc;
+  int depth;
+  int* stack;
+} lexit;
+
+typedef struct ltrace {
+  lchunk* chunk;
+  int count;
+  lir* ir;
+  int nexits;
+  lexit* exits;
+  void* native;
+  int runs;
+  int exits_taken;
+  int running;
+} ltrace;
+
+void ltrace_del(ltrace* t) {
+  ljit_free(t->native);
+  for (int i = 0; i < t->count; i++) { free(t->ir[i].args); }
+  for (int i = 0; i < t->nexits; i++) { free(t->exits[i].stack); }
+  free(t->ir);
+  free(t->exits);
+  free(t);
+}
+
+int ltrace_emit(ltrace* t, int op, int pc) {
+  t->count++;
+  t->ir = realloc(t->ir, sizeof(lir) * t->count);
+  lir* x = &t->ir[t->count-1];
+  x->op = op;
+  x->pc = pc;
+  x->num = 0;
+  x->k = 0;
+  x->fn = NULL;
+  x->a = x->b = -1;
+  x->n = 0;
+  x->args = NULL;
+  x->exit = -1;
+  return t->count-1;
+}
+
+/* Snapshot the abstract stack as the exit for the last instruction */
+void ltrace_snapshot(ltrace* t, int pc, int* stack, int depth) {
+  t->nexits++;
+  t->exits = realloc(t->exits, sizeof(lexit) * t->nexits);
+  lexit* x = &t->exits[t->nexits-1];
+  x->pc = pc;
+  x->depth = depth;
+  x->stack = malloc(sizeof(int) * (depth + 1));
+  memcpy(x->stack, stack, sizeof(int) * depth);
+  t->ir[t->count-1].exit = t->nexits-1;
+}
+
+int ltrace_is_unboxed(ltrace* t, int ref) {
+  int op = t->ir[ref].op;
+  return op == IR_KNUM || op == IR_GET_NUM || op == IR_ARITH || op == IR_CMP;
+}
+
+/* Does the slot of a trace value hold an lval the trace owns */
+int ltrace_is_boxed(ltrace* t, int ref) {
+  int op = t->ir[ref].op;
+  return op == IR_GET || op == IR_CALL;
+}
+
+void lsimp_refresh(lval* f);
+
+/*
+ * Is f, called on n arguments in tail position of chunk c running in
+ * frame e, a call to c again whose arguments can be bound in e itself
+ */
+int ltrace_is_self(lenv* e, lchunk* c, lval* f, int n) {
+  if (f->type != LVAL_FUN || f->builtin) { return 0; }
+  lsimp_refresh(f);
+  return f->chunk == c && e->chunk == c && e->refs == 1 && e->par == f->env
+    && lval_rest(f->formals) < 0 && f->formals->count == n
+    && lenv_fits(e, f->formals);
+}
+
+/* Run a chunk for real while recording its trace */
+lval* ltrace_record(lenv* e, lchunk* c, ltrace** out) {
+
+  ltrace* t = malloc(sizeof(ltrace));
+  t->chunk = c;
+  t->count = 0;
+  t->ir = NULL;
+  t->nexits = 0;
+  t->exits = NULL;
+  t->native = NULL;
+  t->runs = 0;
+  t->exits_taken = 0;
+  t->running = 0;
+
+  lval** stack = malloc(sizeof(lval*) * (c->max_depth + 1));
+  int* refs = malloc(sizeof(int) * (c->max_depth + 1));
+  int depth = 0;
+  unsigned char* ip = c->code;
+
+  for (;;) {
+    int pc = ip - c->code;
+    int arg = ip[1] | (ip[2] << 8);
+    int known = 1;
+
+    switch (*ip) {
+
+      case OP_CONST: {
+        lval* v = c->consts[arg];
+        int r = ltrace_emit(t, v->type == LVAL_NUM ? IR_KNUM : IR_KVAL, pc);
+        t->ir[r].num = v->type == LVAL_NUM ? v->num : 0;
+        t->ir[r].k = arg;
+        stack[depth] = lval_copy(v);
+        refs[depth++] = r;
+      } break;
+
+      case OP_GET: {
+        lval* v = lenv_get(e, c->consts[arg]);
+        int op = IR_GET;
+        if (v->type == LVAL_NUM) { op = IR_GET_NUM; }
+        if (v->type == LVAL_FUN && v->builtin) { op = IR_GET_FN; }
+        int r = ltrace_emit(t, op, pc);
+        t->ir[r].k = arg;
+        if (op == IR_GET_FN) { t->ir[r].fn = v->builtin; }
+        if (op != IR_GET) { ltrace_snapshot(t, pc, refs, depth); }
+        stack[depth] = v;
+        refs[depth++] = r;
+      } break;
+
+      case OP_CALL:
+      case OP_TAILCALL: {
+        int tail = *ip == OP_TAILCALL;
+        int base = depth - arg - 1;
+
+        int self = tail && base == 0 && ltrace_is_self(e, c, stack[0], arg);
+        for (int i = 1; self && i <= arg; i++) {
+          self = stack[i]->type != LVAL_ERR;
+        }
+        if (self) {
+          int r = ltrace_emit(t, IR_LOOP, pc);
+          t->ir[r].n = arg;
+          t->ir[r].args = malloc(sizeof(int) * (arg + 1));
+          memcpy(t->ir[r].args, refs, sizeof(int) * (arg + 1));
+          ltrace_snapshot(t, pc, refs, depth);
+
+          /* This run makes the call as usual, leaving it pending */
+          lval* result = lvm_tailcall(e, stack, arg);
+          free(stack);
+          free(refs);
+          *out = t;
+          return result;
+        }
+
+        lir* f = &t->ir[refs[base]];
+        lbuiltin op = f->op == IR_GET_FN ? f->fn : NULL;
+
+        int unboxed = arg >= 1;
+        for (int i = 1; i <= arg; i++) {
+          unboxed &= ltrace_is_unboxed(t, refs[base+i]);
+        }
+
+        int r;
+        if (unboxed && (op == builtin_add || op == builtin_mul
+            || (op == builtin_sub && arg >= 2))) {
+          /* n-ary arithmetic as a chain of two operand operations */
+          r = refs[base+1];
+          for (int i = 2; i <= arg; i++) {
+            int x = ltrace_emit(t, IR_ARITH, pc);
+            t->ir[x].fn = op;
+            t->ir[x].a = r;
+            t->ir[x].b = refs[base+i];
+            ltrace_snapshot(t, pc, refs, depth);
+            r = x;
+          }
+        } else if (unboxed && arg == 2 && lval_is_compare(op)) {
+          /* Comparisons give 0 or 1, which cannot overflow */
+          r = ltrace_emit(t, IR_CMP, pc);
+          t->ir[r].fn = op;
+          t->ir[r].a = refs[base+1];
+          t->ir[r].b = refs[base+2];
+        } else if (unboxed && op == builtin_sub) {
+          /* Negation is subtraction from zero */
+          int z = ltrace_emit(t, IR_KNUM, pc);
+          r = ltrace_emit(t, IR_ARITH, pc);
+          t->ir[r].fn = op;
+          t->ir[r].a = z;
+          t->ir[r].b = refs[base+1];
+          ltrace_snapshot(t, pc, refs, depth);
+        } else {
+          r = ltrace_emit(t, tail ? IR_TAILCALL : IR_CALL, pc);
+          t->ir[r].n = arg;
+          t->ir[r].fn = op;
+          t->ir[r].args = malloc(sizeof(int) * (arg + 1));
+          memcpy(t->ir[r].args, refs + base, sizeof(int) * (arg + 1));
+        }
+
+        stack[base] = tail
+          ? lvm_tailcall(e, stack + base, arg)
+          : lvm_call(e, stack + base, arg);
+        refs[base] = r;
+        depth = base + 1;
+      } break;
+
+      case OP_RET: {
+        int r = ltrace_emit(t, IR_RET, pc);
+        t->ir[r].a = refs[depth-1];
+        lval* result = stack[depth-1];
+        free(stack);
+        free(refs);
+        *out = t;
+        return result;
+      }
+
+      case OP_JUMP:
+        ip = c->code + arg;
+        continue;
+
+      case OP_IF:
+      case OP_COND:
+      case OP_AND:
+      case OP_OR: {
+        /* A condition which is not a number fails; leave it to the VM */
+        lval* v = stack[depth-1];
+        if (v->type != LVAL_NUM) { known = 0; break; }
+
+        int r = ltrace_emit(t, IR_GUARD, pc);
+        t->ir[r].a = refs[depth-1];
+        t->ir[r].num = v->num != 0;
+        ltrace_snapshot(t, pc, refs, depth);
+
+        int way = lvm_branch(stack + depth - 1, *ip);
+        if (way == LVM_KEEP) { t->ir[r].n = 1; } else { depth--; }
+        if (way != LVM_NEXT) {
+          ip = c->code + arg;
+          continue;
+        }
+      } break;
+
+      default: known = 0; break;
+    }
+
+    if (!known) {
+      /* Not something the recorder understands, just finish the run */
+      free(refs);
+      ltrace_del(t);
+      *out = NULL;
+      return lvm_exec(e, c, stack, stack + depth, ip);
+    }
+    ip += 3;
+  }
+}
+
+/* Fold arithmetic on constants, leaving overflow to the interpreter */
+void ltrace_fold(ltrace* t) {
+  for (int i = 0; i < t->count; i++) {
+    lir* x = &t->ir[i];
+    if (x->op == IR_CMP
+      && t->ir[x->a].op == IR_KNUM && t->ir[x->b].op == IR_KNUM) {
+      long r = t->ir[x->a].num;
+      larith_step(x->fn)(&r, t->ir[x->b].num);
+      x->op = IR_KNUM;
+      x->num = r;
+      continue;
+    }
+    if (x->op != IR_ARITH) { continue; }
+    if (t->ir[x->a].op != IR_KNUM || t->ir[x->b].op != IR_KNUM) { continue; }
+    long a = t->ir[x->a].num, b = t->ir[x->b].num, r = 0;
+    int overflow = 0;
+    if (x->fn == builtin_add) { overflow = __builtin_add_overflow(a, b, &r); }
+    if (x->fn == builtin_sub) { overflow = __builtin_sub_overflow(a, b, &r); }
+    if (x->fn == builtin_mul) { overflow = __builtin_mul_overflow(a, b, &r); }
+    if (overflow) { continue; }
+    x->op = IR_KNUM;
+    x->num = r;
+    x->exit = -1;
+  }
+}
+
+/* Drop guards on bindings already checked since the last impure call */
+void ltrace_dedupe(ltrace* t) {
+
+  int* alias = malloc(sizeof(int) * t->count);
+  int barrier = -1;
+  for (int i = 0; i < t->count; i++) {
+    lir* x = &t->ir[i];
+    alias[i] = i;
+
+    /* Anything may have been redefined, earlier guards no longer hold */
+    if ((x->op == IR_CALL || x->op == IR_TAILCALL)
+        && !(x->fn && lval_is_pure(x->fn))) { barrier = i; }
+
+    if (x->op != IR_GET_NUM && x->op != IR_GET_FN) { continue; }
+    for (int j = barrier + 1; j < i; j++) {
+      lir* y = &t->ir[j];
+      if (y->op != x->op || y->fn != x->fn) { continue; }
+      if (strcmp(t->chunk->consts[y->k]->sym, t->chunk->consts[x->k]->sym)) { continue; }
+      if (x->op == IR_GET_FN) { x->op = IR_FN; }
+      else { x->op = IR_NOP; alias[i] = j; }
+      x->exit = -1;
+      break;
+    }
+  }
+
+  /* Point every use of a removed load at the original */
+  for (int i = 0; i < t->count; i++) {
+    lir* x = &t->ir[i];
+    if (x->a >= 0) { x->a = alias[x->a]; }
+    if (x->b >= 0) { x->b = alias[x->b]; }
+    for (int j = 0; x->args && j <= x->n; j++) { x->args[j] = alias[x->args[j]]; }
+  }
+  for (int i = 0; i < t->nexits; i++) {
+    for (int j = 0; j < t->exits[i].depth; j++) {
+      t->exits[i].stack[j] = alias[t->exits[i].stack[j]];
+    }
+  }
+  free(alias);
+}
+
+/* The symbol of a builtin a trace does inline */
+char* ltrace_op_name(lbuiltin f) {
+  #define LTRACE_ARITH_NAME(name, op) if (f == builtin_##name) { return op; }
+  #define LTRACE_CMP_NAME(name, op, c) if (f == builtin_##name) { return op; }
+  LARITH_OPS(LTRACE_ARITH_NAME)
+  LCMP_OPS(LTRACE_CMP_NAME)
+  #undef LTRACE_ARITH_NAME
+  #undef LTRACE_CMP_NAME
+  return "?";
+}
+
+void ltrace_print(ltrace* t) {
+  for (int i = 0; i < t->count; i++) {
+    lir* x = &t->ir[i];
+    if (x->op == IR_NOP) { continue; }
+    printf("%04i %-9s", i, lir_name(x->op));
+    switch (x->op) {
+      case IR_KNUM: printf("%li", x->num); break;
+      case IR_KVAL: lval_print(t->chunk->consts[x->k]); break;
+      case IR_GET:
+      case IR_GET_NUM:
+      case IR_GET_FN:
+      case IR_FN: lval_print(t->chunk->consts[x->k]); break;
+      case IR_ARITH:
+      case IR_CMP:
+        printf("%s %04i %04i", ltrace_op_name(x->fn), x->a, x->b);
+        break;
+      case IR_CALL:
+      case IR_TAILCALL:
+        for (int j = 0; j <= x->n; j++) { printf("%04i ", x->args[j]); }
+        break;
+      case IR_RET: printf("%04i", x->a); break;
+      case IR_GUARD:
+        printf("%04i %s%s", x->a,
+          x->num ? "true" : "false", x->n ? " kept" : "");
+        break;
+      case IR_LOOP:
+        for (int j = 0; j <= x->n; j++) { printf("%04i ", x->args[j]); }
+        break;
+    }
+    if (x->exit >= 0) { printf(" ; exit to %04i", t->exits[x->exit].pc); }
+    putchar('\n');
+  }
+}
+
+/* Box a trace value, taking ownership of it if it was already boxed */
+lval* ltrace_box(ltrace* t, int ref, long* slots) {
+  lir* x = &t->ir[ref];
+  switch (x->op) {
+    case IR_KNUM: return lval_num(x->num);
+    case IR_KVAL: return lval_copy(t->chunk->consts[x->k]);
+    case IR_GET_NUM:
+    case IR_ARITH:
+    case IR_CMP: return lval_num(slots[ref]);
+    case IR_GET_FN:
+    case IR_FN: return lval_fun(x->fn);
+    default: return (lval*)(size_t)slots[ref];
+  }
+}
+
+void ltrace_call(ltrace* t, int ref, long* slots, lenv* e) {
+  lir* x = &t->ir[ref];
+  lval** base = malloc(sizeof(lval*) * (x->n + 1));
+  for (int i = 0; i <= x->n; i++) { base[i] = ltrace_box(t, x->args[i], slots); }
+  slots[ref] = (long)(size_t)(x->op == IR_TAILCALL
+    ? lvm_tailcall(e, base, x->n)
+    : lvm_call(e, base, x->n));
+  free(base);
+}
+
+/* Does condition v go the way a guard expects? Frees v unless kept */
+int ltrace_test(lval* v, int truth, int keep) {
+  if (v->type != LVAL_NUM || (v->num != 0) != truth) { return 0; }
+  if (!keep) { lval_del(v); }
+  return 1;
+}
+
+/*
+ * Go round the loop ending a trace again, binding the arguments of the
+ * tail call at ref in frame e. Returns 0 to leave the call to the
+ * interpreter through the side exit instead.
+ */
+int ltrace_loop(ltrace* t, int ref, long* slots, lenv* e) {
+  lir* x = &t->ir[ref];
+  if (!ltrace_is_boxed(t, x->args[0])) { return 0; }
+  lval* f = (lval*)(size_t)slots[x->args[0]];
+  if (!ltrace_is_self(e, t->chunk, f, x->n)) { return 0; }
+  for (int i = 1; i <= x->n; i++) {
+    if (!ltrace_is_boxed(t, x->args[i])) { continue; }
+    if (((lval*)(size_t)slots[x->args[i]])->type == LVAL_ERR) { return 0; }
+  }
+
+  lval** args = malloc(sizeof(lval*) * x->n);
+  for (int i = 0; i < x->n; i++) {
+    args[i] = ltrace_box(t, x->args[i+1], slots);
+  }
+  lval_bind(e, f, args, x->n);
+  free(args);
+  lval_del(f);
+  t->runs++;
+  return 1;
+}
+
+lval* ltrace_exit(ltrace* t, int id, long* slots, lenv* e) {
+  lexit* x = &t->exits[id];
+  lchunk* c = t->chunk;
+  lval** stack = malloc(sizeof(lval*) * (c->max_depth + 1));
+  for (int i = 0; i < x->depth; i++) { stack[i] = ltrace_box(t, x->stack[i], slots); }
+  t->exits_taken++;
+  return lvm_exec(e, c, stack, stack + x->depth, c->code + x->pc);
+}
+
+int ltrace_get_num(lenv* e, lval* k, long* out) {
+  lval* v = lenv_peek(e, k);
+  if (!v || v->type != LVAL_NUM) { return 0; }
+  *out = v->num;
+  return 1;
+}
+
+int ltrace_guard_fn(lenv* e, lval* k, lbuiltin f) {
+  lval* v = lenv_peek(e, k);
+  return v && v->type == LVAL_FUN && v->builtin == f;
+}
+
+typedef lval*(*ltrace_fn)(lenv*, long*, lval**);
+
+/* Load a trace value into rax (reg 0) or rcx (reg 1) */
+void ltrace_load(ljit* j, ltrace* t, int ref, int reg) {
+  if (t->ir[ref].op == IR_KNUM) {
+    ljit_byte(j, 0x48); ljit_byte(j, reg ? 0xB9 : 0xB8);
+    ljit_u64(j, (unsigned long long)t->ir[ref].num);
+  } else {
+    ljit_bytes(j, 2, "\x49\x8B"); ljit_byte(j, reg ? 0x8E : 0x86);
+    ljit_u32(j, ref * 8);
+  }
+}
+
+/* mov rdi, imm64 */
+void ltrace_rdi(ljit* j, void* p) {
+  ljit_bytes(j, 2, "\x48\xBF");
+  ljit_u64(j, (unsigned long long)(size_t)p);
+}
+
+int ltrace_compile(ltrace* t) {
+
+  ljit j = { 0, NULL };
+  int* guards = malloc(sizeof(int) * t->count);
+  int nguards = 0;
+  int* guard_exit = malloc(sizeof(int) * t->count);
+
+  /* Prologue, as for the baseline JIT: rbx = env, r14 = slots, r15 = consts */
+  ljit_bytes(&j, 6, "\x55\x53\x41\x56\x41\x57");
+  ljit_bytes(&j, 4, "\x48\x83\xEC\x08");
+  ljit_bytes(&j, 3, "\x48\x89\xFB");
+  ljit_bytes(&j, 3, "\x49\x89\xF6");
+  ljit_bytes(&j, 3, "\x49\x89\xD7");
+  int head = j.count;
+
+  for (int i = 0; i < t->count; i++) {
+    lir* x = &t->ir[i];
+    switch (x->op) {
+      case IR_GET:
+        ljit_bytes(&j, 3, "\x48\x89\xDF");
+        ljit_load_const_rsi(&j, x->k);
+        ljit_call(&j, lenv_get);
+        ljit_bytes(&j, 3, "\x49\x89\x86"); ljit_u32(&j, i * 8);
+        break;
+      case IR_GET_NUM:
+      case IR_GET_FN:
+        ljit_bytes(&j, 3, "\x48\x89\xDF");
+        ljit_load_const_rsi(&j, x->k);
+        if (x->op == IR_GET_NUM) {
+          ljit_bytes(&j, 3, "\x49\x8D\x96"); ljit_u32(&j, i * 8);
+          ljit_call(&j, ltrace_get_num);
+        } else {
+          ljit_bytes(&j, 2, "\x48\xBA");
+          ljit_u64(&j, (unsigned long long)(size_t)x->fn);
+          ljit_call(&j, ltrace_guard_fn);
+        }
+        ljit_bytes(&j, 2, "\x85\xC0");
+        guards[nguards] = ljit_jump(&j, "\x0F\x84", 2);
+        guard_exit[nguards++] = x->exit;
+        break;
+      case IR_ARITH:
+        ltrace_load(&j, t, x->a, 0);
+        ltrace_load(&j, t, x->b, 1);
+        if (x->fn == builtin_add) { ljit_bytes(&j, 3, "\x48\x01\xC8"); }
+        if (x->fn == builtin_sub) { ljit_bytes(&j, 3, "\x48\x29\xC8"); }
+        if (x->fn == builtin_mul) { ljit_bytes(&j, 4, "\x48\x0F\xAF\xC1"); }
+        guards[nguards] = ljit_jump(&j, "\x0F\x80", 2);
+        guard_exit[nguards++] = x->exit;
+        ljit_bytes(&j, 3, "\x49\x89\x86"); ljit_u32(&j, i * 8);
+        break;
+      case IR_CMP: {
+        /* cmp rax, rcx; setcc al; movzx eax, al */
+        unsigned char cc =
+            x->fn == builtin_lt ? 0x9C : x->fn == builtin_gt ? 0x9F
+          : x->fn == builtin_le ? 0x9E : x->fn == builtin_ge ? 0x9D
+          : x->fn == builtin_eq ? 0x94 : 0x95;
+        ltrace_load(&j, t, x->a, 0);
+        ltrace_load(&j, t, x->b, 1);
+        ljit_bytes(&j, 3, "\x48\x39\xC8");
+        ljit_byte(&j, 0x0F); ljit_byte(&j, cc); ljit_byte(&j, 0xC0);
+        ljit_bytes(&j, 3, "\x0F\xB6\xC0");
+        ljit_bytes(&j, 3, "\x49\x89\x86"); ljit_u32(&j, i * 8);
+      } break;
+      case IR_CALL:
+      case IR_TAILCALL:
+        ltrace_rdi(&j, t);
+        ljit_byte(&j, 0xBE); ljit_u32(&j, i);
+        ljit_bytes(&j, 3, "\x4C\x89\xF2");
+        ljit_bytes(&j, 3, "\x48\x89\xD9");
+        ljit_call(&j, ltrace_call);
+        break;
+      case IR_RET:
+        ltrace_rdi(&j, t);
+        ljit_byte(&j, 0xBE); ljit_u32(&j, x->a);
+        ljit_bytes(&j, 3, "\x4C\x89\xF2");
+        ljit_call(&j, ltrace_box);
+        ljit_bytes(&j, 4, "\x48\x83\xC4\x08");
+        ljit_bytes(&j, 6, "\x41\x5F\x41\x5E\x5B\x5D");
+        ljit_byte(&j, 0xC3);
+        break;
+      case IR_GUARD:
+        if (ltrace_is_unboxed(t, x->a)) {
+          /* test rax, rax; jz or jnz exit */
+          ltrace_load(&j, t, x->a, 0);
+          ljit_bytes(&j, 3, "\x48\x85\xC0");
+          guards[nguards] = ljit_jump(&j, x->num ? "\x0F\x84" : "\x0F\x85", 2);
+        } else {
+          /* ltrace_test([r14 + a*8], truth, keep); test eax, eax; jz exit */
+          ljit_bytes(&j, 3, "\x49\x8B\xBE"); ljit_u32(&j, x->a * 8);
+          ljit_byte(&j, 0xBE); ljit_u32(&j, x->num);
+          ljit_byte(&j, 0xBA); ljit_u32(&j, x->n);
+          ljit_call(&j, ltrace_test);
+          ljit_bytes(&j, 2, "\x85\xC0");
+          guards[nguards] = ljit_jump(&j, "\x0F\x84", 2);
+        }
+        guard_exit[nguards++] = x->exit;
+        break;
+      case IR_LOOP:
+        /* ltrace_loop(t, i, slots, env); test eax, eax; jz exit; jmp head */
+        ltrace_rdi(&j, t);
+        ljit_byte(&j, 0xBE); ljit_u32(&j, i);
+        ljit_bytes(&j, 3, "\x4C\x89\xF2");
+        ljit_bytes(&j, 3, "\x48\x89\xD9");
+        ljit_call(&j, ltrace_loop);
+        ljit_bytes(&j, 2, "\x85\xC0");
+        guards[nguards] = ljit_jump(&j, "\x0F\x84", 2);
+        guard_exit[nguards++] = x->exit;
+        ljit_patch(&j, ljit_jump(&j, "\xE9", 1), head);
+        break;
+    }
+  }
+
+  /* Side exits: ltrace_exit(t, id, slots, env) finishes in the VM */
+  for (int i = 0; i < nguards; i++) {
+    ljit_patch(&j, guards[i], j.count);
+    ltrace_rdi(&j, t);
+    ljit_byte(&j, 0xBE); ljit_u32(&j, guard_exit[i]);
+    ljit_bytes(&j, 3, "\x4C\x89\xF2");
+    ljit_bytes(&j, 3, "\x48\x89\xD9");
+    ljit_call(&j, ltrace_exit);
+    ljit_bytes(&j, 4, "\x48\x83\xC4\x08");
+    ljit_bytes(&j, 6, "\x41\x5F\x41\x5E\x5B\x5D");
+    ljit_byte(&j, 0xC3);
+  }
+  free(guards);
+  free(guard_exit);
+
+  t->native = ljit_install(&j);
+  return t->native != NULL;
+}
+
+lval* ltrace_run(lenv* e, ltrace* t) {
+  long* slots = malloc(sizeof(long) * t->count);
+  t->runs++;
+  t->running++;
+  lval* result = ((ltrace_fn)t->native)(e, slots, t->chunk->consts);
+  t->running--;
+  free(slots);
+  return result;
+}
+
+/* Record a hot chunk, optimize the trace and compile it */
+lval* ltrace_start(lenv* e, lchunk* c) {
+  ltrace* t;
+  
+  /* Calls to c made while recording run as usual, rather than record too */
+  c->trace_failed = 1;
+  lval* result = ltrace_record(e, c, &t);
+  if (!t) { return result; }
+
+  ltrace_fold(t);
+  ltrace_dedupe(t);
+  if (hoagie_dump_trace) { ltrace_print(t); }
+
+  if (ltrace_compile(t)) {
+    c->trace = t;
+    c->trace_failed = 0;
+  } else {
+    ltrace_del(t);
+  }
+  return result;
+}
+
+#endif
+
+/* Run a chunk once, returning NULL if it ended in a pending tail call */
+lval* lvm_run_chunk(lenv* e, lchunk* c) {
+
+  if (c->oversized) { return lval_eval(e, lval_copy(c->body)); }
+  c->calls++;
+
+  #ifdef HOAGIE_JIT
+  if (c->trace) {
+    ltrace* t = c->trace;
+    lval* result = ltrace_run(e, t);
+
+    /* Give up on traces which keep leaving through side exits, but
+       not while an outer call is still running the same native code */
+    if (!t->running && t->exits_taken > 10 && t->exits_taken * 2 > t->runs) {
+      c->trace = NULL;
+      c->trace_failed = 1;
+      ltrace_del(t);
+    }
+    return result;
+  }
+  if (!c->trace_failed && hoagie_trace && c->calls >= hoagie_trace_threshold) {
+    return ltrace_start(e, c);
+  }
+  #endif
+
+  if (!c->native && !c->jit_failed && hoagie_jit
+      && c->calls >= hoagie_jit_threshold) {
+    lchunk_jit(c);
+  }
+
+  lval** stack = malloc(sizeof(lval*) * (c->max_depth + 1));
+
+  #ifdef HOAGIE_JIT
+  if (c->native) {
+    lval* result = ((ljit_fn)c->native)(e, stack, c->consts);
+    free(stack);
+    return result;
+  }
+  #endif
+
+  return lvm_exec(e, c, stack, stack, c->code);
+}
+
+/*
+ * Run a chunk, making any tail calls it ends with in a loop here. The
+ * frame for those is reused while the same function keeps calling
+ * itself, so self recursion in tail position runs in constant space.
+ */
+lval* lvm_run(lenv* e, lchunk* c) {
+
+  lenv* frame = NULL;
+  lval* fn = NULL;
+  lval* result = lstack_check();
+  if (result) { return result; }
+
+  if (++hoagie_stats.vm_depth > hoagie_stats.max_vm_depth) {
+    hoagie_stats.max_vm_depth = hoagie_stats.vm_depth;
+  }
+
+  while (!(result = lvm_run_chunk(e, c))) {
+    lval* f = lvm_tail_fn;
+    frame = lenv_frame(e, f, frame);
+    lval* err = lval_bind(frame, f, lvm_tail_args, lvm_tail_count);
+    if (err) { lval_del(f); result = err; break; }
+
+    /* Keep the callee alive while its body runs */
+    if (fn) { lval_del(fn); }
+    fn = f;
+    c = f->chunk;
+    e = frame;
+  }
+
+  if (fn) { lval_del(fn); }
+  if (frame) { lenv_del(frame); }
+  hoagie_stats.vm_depth--;
+  return result;
+}
+
+/* Engine Selection */
+
+enum { ENGINE_TREE, ENGINE_VM };
+
+int hoagie_engine = ENGINE_TREE;
+int hoagie_dump_bytecode = 0;
+
+/* Nesting of lval_run, which frees old call site cache entries when done */
+int lval_run_depth = 0;
+
+lval* lval_run(lenv* e, lval* v) {
+  lval* x;
+  if (lval_run_depth == 0) {
+    lstack_base = (uintptr_t)&x;
+  } else if ((x = lstack_check())) {
+    lval_del(v);
+    return x;
+  }
+  lval_run_depth++;
+  v = lval_simplify_expr(e, v);
+  if (hoagie_engine == ENGINE_TREE) {
+    x = lval_eval(e, v);
+  } else {
+    lchunk* c = lval_compile(v);
+    if (c->oversized) {
+      x = lval_eval(e, v);
+    } else {
+      lval_del(v);
+      if (hoagie_dump_bytecode) { lchunk_print(c); }
+      x = lvm_run(e, c);
+    }
+    lchunk_del(c);
+  }
+  if (--lval_run_depth == 0) { lcache_collect(); }
+  return x;
+}
+
+/*
+ * Calls from a builtin to function fn, made over and over by those
+ * walking lists. A lambda runs in a call frame reused from one call to
+ * the next, unless something else has kept hold of it, and the tree
+ * evaluator keeps its stacks, so calls after the first need allocate
+ * neither.
+ */
+struct lcall {
+  lenv* env;
+  lval* fn;
+  lenv* frame;
+  leval* m;
+};
+
+lcall* lcall_new(lenv* e, lval* f) {
+  lcall* c = malloc(sizeof(lcall));
+  c->env = e;
+  c->fn = f;
+  c->frame = NULL;
+  c->m = NULL;
+  return c;
+}
+
+/* Call the function on n arguments, taking ownership of them */
+lval* lcall_run(lcall* c, lval** args, int n) {
+  lval* f = c->fn;
+  if (f->builtin) { return lvm_apply(c->env, f->builtin, args, n); }
+  
+  lval* r = lstack_check();
+  if (r) {
+    for (int i = 0; i < n; i++) { lval_del(args[i]); }
+    return r;
+  }
+  c->frame = lenv_frame(c->env, f, c->frame);
+  r = lval_bind(c->frame, f, args, n);
+  if (r) { return r; }
+  if (hoagie_engine == ENGINE_VM) { return lvm_run(c->frame, f->chunk); }
+  
+  if (!c->m) { c->m = leval_alloc(); }
+  leval_push(c->m, c->frame, lchunk_body(f->chunk), NULL);
+  leval_run(c->m, -1);
+  r = c->m->result;
+  c->m->result = NULL;
+  return r;
+}
+
+void lcall_del(lcall* c) {
+  if (c->frame) { lenv_del(c->frame); }
+  if (c->m) { leval_del(c->m); }
+  free(c);
+}
+
+/*
+ * Memoization. (memo f) makes a function taking any arguments, which
+ * gives what f gave last time it was called with equal ones, or calls
+ * f and keeps the result. It is a closure of
+ *
+ *   (\ {& args} {<builtin> f args})
+ *
+ * whose environment, shared by its copies, holds a hash table of the
+ * argument lists seen and their results. The table holds the given
+ * number of results at most, 1024 unless told otherwise, forgetting
+ * the least recently used to make room. f is assumed to be pure, so it
+ * is not called again for the same arguments, even if it gave an error.
+ * Calls which ran out of C stack are the exception, as made from less
+ * deep they may not, so building up a table from small arguments first
+ * reaches further.
+ */
+
+typedef struct lmemo_entry {
+  unsigned long hash;
+  lval* args;
+  lval* result;
+  /* Next in its bucket, and either way in order of use */
+  struct lmemo_entry* next;
+  struct lmemo_entry* newer;
+  struct lmemo_entry* older;
+} lmemo_entry;
+
+typedef struct lmemo {
+  lmemo_entry** buckets;
+  long nbuckets;
+  long count;
+  long size;
+  lmemo_entry* newest;
+  lmemo_entry* oldest;
+  long hits;
+  long misses;
+  long evictions;
+} lmemo;
+
+#define LMEMO_SIZE 1024
+
+lmemo* lmemo_new(long size) {
+  lmemo* m = malloc(sizeof(lmemo));
+  m->nbuckets = 16;
+  m->buckets = calloc(m->nbuckets, sizeof(lmemo_entry*));
+  m->count = 0;
+  m->size = size;
+  m->newest = NULL;
+  m->oldest = NULL;
+  m->hits = 0;
+  m->misses = 0;
+  m->evictions = 0;
+  return m;
+}
+
+void lmemo_del(lmemo* m) {
+  for (lmemo_entry* x = m->newest; x;) {
+    lmemo_entry* older = x->older;
+    lval_del(x->args);
+    lval_del(x->result);
+    free(x);
+    x = older;
+  }
+  free(m->buckets);
+  free(m);
+}
+
+/* Take x out of the order of use */
+void lmemo_unlink(lmemo* m, lmemo_entry* x) {
+  if (x->newer) { x->newer->older = x->older; } else { m->newest = x->older; }
+  if (x->older) { x->older->newer = x->newer; } else { m->oldest = x->newer; }
+}
+
+/* Put x first in the order of use */
+void lmemo_touch(lmemo* m, lmemo_entry* x) {
+  x->newer = NULL;
+  x->older = m->newest;
+  if (m->newest) { m->newest->newer = x; } else { m->oldest = x; }
+  m->newest = x;
+}
+
+lmemo_entry* lmemo_find(lmemo* m, lval* args, unsigned long hash) {
+  lmemo_entry* x = m->buckets[hash & (m->nbuckets - 1)];
+  while (x && (x->hash != hash || !lval_eq(x->args, args))) { x = x->next; }
+  return x;
+}
+
+void lmemo_evict(lmemo* m) {
+  lmemo_entry* x = m->oldest;
+  lmemo_entry** at = &m->buckets[x->hash & (m->nbuckets - 1)];
+  while (*at != x) { at = &(*at)->next; }
+  *at = x->next;
+  lmemo_unlink(m, x);
+  lval_del(x->args);
+  lval_del(x->result);
+  free(x);
+  m->count--;
+  m->evictions++;
+}
+
+/* Keep a copy of result for args, which the table takes */
+void lmemo_add(lmemo* m, lval* args, unsigned long hash, lval* result) {
+  if (m->count == m->size) { lmemo_evict(m); }
+  
+  /* Keep buckets no fewer than entries */
+  if (m->count == m->nbuckets) {
+    long n = m->nbuckets * 2;
+    lmemo_entry** buckets = calloc(n, sizeof(lmemo_entry*));
+    for (lmemo_entry* x = m->newest; x; x = x->older) {
+      x->next = buckets[x->hash & (n - 1)];
+      buckets[x->hash & (n - 1)] = x;
+    }
+    free(m->buckets);
+    m->buckets = buckets;
+    m->nbuckets = n;
+  }
+  
+  lmemo_entry* x = malloc(sizeof(lmemo_entry));
+  x->hash = hash;
+  x->args = args;
+  x->result = lval_copy(result);
+  x->next = m->buckets[hash & (m->nbuckets - 1)];
+  m->buckets[hash & (m->nbuckets - 1)] = x;
+  lmemo_touch(m, x);
+  m->count++;
+}
+
+/* The table of the function made by memo that e is a frame of a call to */
+lmemo* lmemo_of(lenv* e) {
+  while (e && !e->memo) { e = e->par; }
+  return e ? e->memo : NULL;
+}
+
+/* Body of a function made by memo, given f and the list of arguments */
+lval* builtin_memo_call(lenv* e, lval* a) {
+  lmemo* m = lmemo_of(e);
+  lval* f = lval_pop(a, 0);
+  lval* args = lval_take(a, 0);
+  unsigned long hash = lval_hash(args);
+  
+  lmemo_entry* x = m ? lmemo_find(m, args, hash) : NULL;
+  if (x) {
+    m->hits++;
+    lmemo_unlink(m, x);
+    lmemo_touch(m, x);
+    lval_del(f);
+    lval_del(args);
+    return lval_copy(x->result);
+  }
+  
+  int n = args->count;
+  lval** copies = malloc(sizeof(lval*) * n);
+  for (int i = 0; i < n; i++) { copies[i] = lval_copy(args->cell[i]); }
+  lcall* c = lcall_new(e, f);
+  long overflows = lstack_overflows;
+  lval* r = lcall_run(c, copies, n);
+  lcall_del(c);
+  free(copies);
+  lval_del(f);
+  
+  /* Calls made by f may have kept a result for the same arguments */
+  if (m) { m->misses++; }
+  if (m && lstack_overflows == overflows && !lmemo_find(m, args, hash)) {
+    lmemo_add(m, args, hash, r);
+  } else {
+    lval_del(args);
+  }
+  return r;
+}
+
+lval* builtin_memo(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'memo' passed incorrect number of arguments. "
+    "Got %i, Expected 1 or 2.", a->count);
+  LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+  long size = LMEMO_SIZE;
+  if (a->count == 2) {
+    LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+    LASSERT(a, a->cell[1]->num > 0,
+      "Function 'memo' passed size %li, Expected at least 1.", a->cell[1]->num);
+    size = a->cell[1]->num;
+  }
+  
+  lenv* g = e;
+  while (g->par) { g = g->par; }
+  lenv* frame = lenv_new();
+  frame->par = g;
+  frame->memo = lmemo_new(size);
+  
+  lval* formals = lval_add(lval_add(lval_qexpr(), lval_sym("&")), lval_sym("args"));
+  lval* body = lval_add(lval_qexpr(), lval_fun(builtin_memo_call));
+  body = lval_add(body, lval_pop(a, 0));
+  body = lval_add(body, lval_sym("args"));
+  lval_del(a);
+  return lval_closure(frame, formals, body);
+}
+
+/* {hits misses evictions count size} of function f made by memo */
+lval* builtin_memo_stats(lenv* e, lval* a) {
+  LASSERT_NUM("memo-stats", a, 1);
+  LASSERT_TYPE("memo-stats", a, 0, LVAL_FUN);
+  lval* f = a->cell[0];
+  LASSERT(a, !f->builtin && f->env->memo,
+    "Function 'memo-stats' passed a function not made by memo.");
+  
+  lmemo* m = f->env->memo;
+  lval* x = lval_qexpr();
+  x = lval_add(x, lval_num(m->hits));
+  x = lval_add(x, lval_num(m->misses));
+  x = lval_add(x, lval_num(m->evictions));
+  x = lval_add(x, lval_num(m->count));
+  x = lval_add(x, lval_num(m->size));
+  lval_del(a);
+  return x;
+}
+
+/* Compilation to C */
+
+/*
+ * Translates each top-level expression of a program into a C function
+ * built from the runtime interface in hoagie.h. Calls to builtins the
+ * program can never rebind skip the lookup, and arithmetic on literal
+ * numbers becomes plain C arithmetic. Everything else goes through
+ * lvm_call exactly as the VM would.
+ */
+
+typedef struct {
+  char* name;
+  char* func;
+} lcbuiltin;
+
+lcbuiltin lcgen_builtins[] = {
+  { "\\", "builtin_lambda" }, { "def", "builtin_def" },
+  { "list", "builtin_list" }, { "head", "builtin_head" },
+  { "tail", "builtin_tail" }, { "eval", "builtin_eval" },
+  { "join", "builtin_join" }, { "map", "builtin_map" },
+  { "filter", "builtin_filter" }, { "fold", "builtin_fold" },
+  { "reduce", "builtin_reduce" }, { "take", "builtin_take" },
+  { "len", "builtin_len" }, { "nth", "builtin_nth" },
+  { "last", "builtin_last" }, { "slice", "builtin_slice" },
+  { "sort", "builtin_sort" }, { "sort-by", "builtin_sort_by" },
+  { "uniq", "builtin_uniq" }, { "bsearch", "builtin_bsearch" },
+  { "+", "builtin_add" }, { "-", "builtin_sub" }, { "*", "builtin_mul" },
+  { "/", "builtin_div" }, { "%", "builtin_mod" },
+  { "<", "builtin_lt" }, { ">", "builtin_gt" }, { "<=", "builtin_le" },
+  { ">=", "builtin_ge" }, { "==", "builtin_eq" }, { "!=", "builtin_ne" },
+  { "hash", "builtin_hash" }, { "memo", "builtin_memo" },
+  { "memo-stats", "builtin_memo_stats" },
+  { "if", "builtin_if" }, { "cond", "builtin_cond" },
+  { "and", "builtin_and" }, { "or", "builtin_or" },
+  { "while", "builtin_while" }, { "dotimes", "builtin_dotimes" },
+  { "for-each", "builtin_for_each" },
+  { NULL, NULL }
+};
+
+typedef struct {
+  FILE* out;
+  lval* program;
+  int temps;
+
+  /* Symbols and quoted values, built once when the program starts */
+  int nsyms;
+  char** syms;
+  int nconsts;
+  lval** consts;
+} lcgen;
+
+/* Is the symbol named anywhere inside a Q-Expression of v */
+int lcgen_quoted(lval* v, char* sym, int quoted) {
+  if (v->type == LVAL_SYM) { return quoted && strcmp(v->sym, sym) == 0; }
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return 0; }
+  for (int i = 0; i < v->count; i++) {
+    if (lcgen_quoted(v->cell[i], sym, quoted || v->type == LVAL_QEXPR)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * A builtin can only be rebound with def, and def only takes symbols
+ * from a Q-Expression, so if the name is never quoted it is constant.
+ */
+char* lcgen_builtin(lcgen* g, lval* v) {
+  if (v->type != LVAL_SYM) { return NULL; }
+  for (int i = 0; lcgen_builtins[i].name; i++) {
+    if (strcmp(lcgen_builtins[i].name, v->sym) == 0) {
+      return lcgen_quoted(g->program, v->sym, 0) ? NULL : lcgen_builtins[i].func;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Fold an expression of literal numbers and constant arithmetic into x.
+ * Anything that would be an error at run time is left to the runtime.
+ */
+int lcgen_fold(lcgen* g, lval* v, long* x) {
+  if (v->type == LVAL_NUM) { *x = v->num; return 1; }
+  if (v->type != LVAL_SEXPR || v->count < 2) { return 0; }
+  char* f = lcgen_builtin(g, v->cell[0]);
+  if (!f) { return 0; }
+
+  int n = v->count - 1;
+  lval** args = calloc(n, sizeof(lval*));
+  int ok = 1;
+  for (int i = 0; i < n && ok; i++) {
+    long y;
+    ok = lcgen_fold(g, v->cell[i+1], &y);
+    args[i] = ok ? lval_num(y) : NULL;
+  }
+
+  int status = LARITH_OVERFLOW;
+  #define LARITH_FOLD(name, op) \
+    if (ok && strcmp(f, "builtin_" #name) == 0) { status = larith_##name##_n(x, args, n); }
+  LARITH_OPS(LARITH_FOLD)
+  #undef LARITH_FOLD
+
+  for (int i = 0; i < n; i++) { if (args[i]) { lval_del(args[i]); } }
+  free(args);
+  return status == LARITH_OK;
+}
+
+void lcgen_long(lcgen* g, long x) {
+  if (x == LONG_MIN) { fprintf(g->out, "(%liL - 1)", x + 1); }
+  else { fprintf(g->out, "%liL", x); }
+}
+
+int lcgen_sym(lcgen* g, char* sym) {
+  for (int i = 0; i < g->nsyms; i++) {
+    if (strcmp(g->syms[i], sym) == 0) { return i; }
+  }
+  g->nsyms++;
+  g->syms = realloc(g->syms, sizeof(char*) * g->nsyms);
+  g->syms[g->nsyms-1] = sym;
+  return g->nsyms-1;
+}
+
+int lcgen_const(lcgen* g, lval* v) {
+  g->nconsts++;
+  g->consts = realloc(g->consts, sizeof(lval*) * g->nconsts);
+  g->consts[g->nconsts-1] = v;
+  return g->nconsts-1;
+}
+
+void lcgen_string(lcgen* g, char* s) {
+  fputc('"', g->out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') { fputc('\\', g->out); }
+    fputc(*s, g->out);
+  }
+  fputc('"', g->out);
+}
+
+/* Print a C expression which builds a copy of the literal v */
+void lcgen_literal(lcgen* g, lval* v) {
+  switch (v->type) {
+    case LVAL_NUM:
+      fprintf(g->out, "lval_num(");
+      lcgen_long(g, v->num);
+      fprintf(g->out, ")");
+      break;
+    case LVAL_SYM:
+      fprintf(g->out, "lval_sym(");
+      lcgen_string(g, v->sym);
+      fprintf(g->out, ")");
+      break;
+    case LVAL_ERR:
+      fprintf(g->out, "lval_err(\"%%s\", ");
+      lcgen_string(g, v->err);
+      fprintf(g->out, ")");
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) { fprintf(g->out, "lval_add("); }
+      fprintf(g->out, v->type == LVAL_SEXPR ? "lval_sexpr()" : "lval_qexpr()");
+      for (int i = 0; i < v->count; i++) {
+        fprintf(g->out, ", ");
+        lcgen_literal(g, v->cell[i]);
+        fprintf(g->out, ")");
+      }
+      break;
+  }
+}
+
+int lcgen_expr(lcgen* g, lval* v);
+
+/*
+ * A branch of if or cond, in statements assigning temporary t. Those
+ * given as Q-Expressions are run as code.
+ */
+void lcgen_branch(lcgen* g, lval* v, int t) {
+  int r;
+  if (v->type == LVAL_QEXPR && v->count == 0) {
+    r = g->temps++;
+    fprintf(g->out, "  lval* t%i = lval_sexpr();\n", r);
+  } else if (v->type == LVAL_QEXPR) {
+    v->type = LVAL_SEXPR;
+    r = lcgen_expr(g, v);
+    v->type = LVAL_QEXPR;
+  } else {
+    r = lcgen_expr(g, v);
+  }
+  fprintf(g->out, "  t%i = t%i;\n", t, r);
+}
+
+int lcgen_is_form(char* f) {
+  return strcmp(f, "builtin_if") == 0 || strcmp(f, "builtin_cond") == 0
+      || strcmp(f, "builtin_and") == 0 || strcmp(f, "builtin_or") == 0;
+}
+
+/* Is v the name of a special form */
+int lcgen_form_name(lval* v) {
+  if (v->type != LVAL_SYM) { return 0; }
+  return strcmp(v->sym, "if") == 0 || strcmp(v->sym, "cond") == 0
+      || strcmp(v->sym, "and") == 0 || strcmp(v->sym, "or") == 0
+      || strcmp(v->sym, "while") == 0 || strcmp(v->sym, "dotimes") == 0
+      || strcmp(v->sym, "for-each") == 0;
+}
+
+/*
+ * Conditionals the program never rebinds become C conditionals, each
+ * cell evaluated in a block entered only if it is needed. The value
+ * of the form goes in temporary t.
+ */
+void lcgen_form(lcgen* g, lval* v, char* f, int t) {
+  int logic = strcmp(f, "builtin_and") == 0 || strcmp(f, "builtin_or") == 0;
+  int stop = strcmp(f, "builtin_or") == 0;
+  char* name = f + strlen("builtin_");
+  int last = v->count - 1;
+  int blocks = 0;
+  
+  int i = 1;
+  for (; i < last; i += logic ? 1 : 2) {
+    int c = lcgen_expr(g, v->cell[i]);
+    fprintf(g->out, "  t%i = lval_test(t%i, \"%s\");\n", t, c, name);
+    fprintf(g->out, "  if (!t%i) {\n", t);
+    if (logic) {
+      fprintf(g->out, "  if ((t%i->num != 0) == %i) { t%i = t%i; } else {\n", c, stop, t, c);
+      fprintf(g->out, "  lval_del(t%i);\n", c);
+    } else {
+      fprintf(g->out, "  int c%i = t%i->num != 0;\n", c, c);
+      fprintf(g->out, "  lval_del(t%i);\n", c);
+      fprintf(g->out, "  if (c%i) {\n", c);
+      lcgen_branch(g, v->cell[i+1], t);
+      fprintf(g->out, "  } else {\n");
+    }
+    blocks += 2;
+  }
+  
+  /* The last operand or branch, or () if cond took none */
+  if (i > last) {
+    fprintf(g->out, "  t%i = lval_sexpr();\n", t);
+  } else if (logic) {
+    fprintf(g->out, "  t%i = t%i;\n", t, lcgen_expr(g, v->cell[i]));
+  } else {
+    lcgen_branch(g, v->cell[i], t);
+  }
+  for (int k = 0; k < blocks; k++) { fprintf(g->out, "  }\n"); }
+}
+
+/* Emit statements evaluating v and return the temporary holding it */
+int lcgen_expr(lcgen* g, lval* v) {
+
+  long x;
+  if (lcgen_fold(g, v, &x)) {
+    int t = g->temps++;
+    fprintf(g->out, "  lval* t%i = lval_num(", t);
+    lcgen_long(g, x);
+    fprintf(g->out, ");\n");
+    return t;
+  }
+
+  if (v->type == LVAL_SYM) {
+    int t = g->temps++;
+    fprintf(g->out, "  lval* t%i = lenv_get(e, hg_syms[%i]);\n", t, lcgen_sym(g, v->sym));
+    return t;
+  }
+
+  if (v->type == LVAL_SEXPR && v->count == 1) { return lcgen_expr(g, v->cell[0]); }
+
+  if (v->type == LVAL_SEXPR && v->count > 1) {
+    char* f = lcgen_builtin(g, v->cell[0]);
+    if (f && lcgen_is_form(f) && (strcmp(f, "builtin_if") != 0 || v->count == 4)) {
+      int t = g->temps++;
+      fprintf(g->out, "  lval* t%i;\n", t);
+      lcgen_form(g, v, f, t);
+      return t;
+    }
+    
+    /*
+     * One which may be rebound is left to eval, to settle when it runs,
+     * as are loops, which need a loop frame
+     */
+    if ((!f || !lcgen_is_form(f)) && lcgen_form_name(v->cell[0])) {
+      int t = g->temps++;
+      fprintf(g->out, "  lval* t%i = lval_copy(hg_consts[%i]);\n", t, lcgen_const(g, v));
+      fprintf(g->out, "  t%i->type = LVAL_QEXPR;\n", t);
+      fprintf(g->out, "  t%i = builtin_eval(e, lval_add(lval_sexpr(), t%i));\n", t, t);
+      return t;
+    }
+    int first = f ? 1 : 0;
+    int n = v->count - first;
+
+    int* args = malloc(sizeof(int) * n);
+    for (int i = 0; i < n; i++) { args[i] = lcgen_expr(g, v->cell[first+i]); }
+
+    int t = g->temps++;
+    fprintf(g->out, "  lval* a%i[] = {", t);
+    for (int i = 0; i < n; i++) { fprintf(g->out, "%s t%i", i ? "," : "", args[i]); }
+    fprintf(g->out, " };\n");
+    if (f) {
+      fprintf(g->out, "  lval* t%i = lvm_apply(e, %s, a%i, %i);\n", t, f, t, n);
+    } else {
+      fprintf(g->out, "  lval* t%i = lvm_call(e, a%i, %i);\n", t, t, n-1);
+    }
+    free(args);
+    return t;
+  }
+
+  /* Numbers, errors, Q-Expressions and () evaluate to themselves */
+  int t = g->temps++;
+  fprintf(g->out, "  lval* t%i = lval_copy(hg_consts[%i]);\n", t, lcgen_const(g, v));
+  return t;
+}
+
+void lval_compile_c(lval* program, char* source, FILE* out) {
+
+  /* Forms go to a scratch file first, to learn what needs building */
+  FILE* body = tmpfile();
+  lcgen g = { body, program, 0, 0, NULL, 0, NULL };
+
+  for (int i = 0; i < program->count; i++) {
+    g.temps = 0;
+    fprintf(body, "static lval* hg_form_%i(lenv* e) {\n", i);
+    int t = lcgen_expr(&g, program->cell[i]);
+    fprintf(body, "  return t%i;\n}\n\n", t);
+  }
+
+  fprintf(out, "/* Generated by hoagie --compile from %s */\n\n", source);
+  fprintf(out, "#include \"hoagie.h\"\n\n");
+  fprintf(out, "static lval* hg_syms[%i];\n", g.nsyms + 1);
+  fprintf(out, "static lval* hg_consts[%i];\n\n", g.nconsts + 1);
+
+  rewind(body);
+  int ch;
+  while ((ch = fgetc(body)) != EOF) { fputc(ch, out); }
+  fclose(body);
+
+  g.out = out;
+  fprintf(out, "int main(int argc, char** argv) {\n");
+  fprintf(out, "  lenv* e = lenv_new();\n");
+  fprintf(out, "  lenv_add_builtins(e);\n\n");
+  for (int i = 0; i < g.nsyms; i++) {
+    fprintf(out, "  hg_syms[%i] = lval_sym(", i);
+    lcgen_string(&g, g.syms[i]);
+    fprintf(out, ");\n");
+  }
+  for (int i = 0; i < g.nconsts; i++) {
+    fprintf(out, "  hg_consts[%i] = ", i);
+    lcgen_literal(&g, g.consts[i]);
+    fprintf(out, ";\n");
+  }
+
+  fprintf(out, "\n  lval* x;\n");
+  for (int i = 0; i < program->count; i++) {
+    fprintf(out, "  x = hg_form_%i(e); lval_println(x); lval_del(x);\n", i);
+  }
+
+  fprintf(out, "\n  for (int i = 0; i < %i; i++) { lval_del(hg_syms[i]); }\n", g.nsyms);
+  fprintf(out, "  for (int i = 0; i < %i; i++) { lval_del(hg_consts[i]); }\n", g.nconsts);
+  fprintf(out, "  lenv_del(e);\n");
+  fprintf(out, "  return 0;\n}\n");
+
+  free(g.syms);
+  free(g.consts);
+}
+
+/* Reading */
+
+lval* lval_read_num(mpc_ast_t* t) {
+  errno = 0;
+  long x = strtol(t->contents, NULL, 10);
+  return errno != ERANGE ? lval_num(x) : lval_err("Invalid Number.");
 }
 
 lval* lval_read(mpc_ast_t* t) {
@@ -611,6 +5956,8 @@ lval* lval_read(mpc_ast_t* t) {
 
 /* Main */
 
+#ifndef HOAGIE_RUNTIME
+
 int main(int argc, char** argv) {
   
   mpc_parser_t* Number = mpc_new("number");
@@ -631,20 +5978,102 @@ int main(int argc, char** argv) {
     ",
     Number, Symbol, Sexpr, Qexpr, Expr, Hoagie);
   
-  puts("Hoagie Version 0.0.0.10");
-  puts("Press Ctrl+c to Exit\n");
-  
   lenv* e = lenv_new();
   lenv_add_builtins(e);
-  
-  while (1) {
+
+  /* Command line options, anything else is a file to load */
+  int files = 0;
+  char* compile = NULL;
+  char* output = NULL;
+  int stats = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--engine") == 0 && i+1 < argc) {
+      i++;
+      if (strcmp(argv[i], "tree") == 0) { hoagie_engine = ENGINE_TREE; continue; }
+      if (strcmp(argv[i], "vm") == 0) { hoagie_engine = ENGINE_VM; continue; }
+      fprintf(stderr, "Unknown engine '%s'. Expected tree or vm.\n", argv[i]);
+      return 1;
+    }
+    if (strcmp(argv[i], "--dump-bytecode") == 0) { hoagie_dump_bytecode = 1; continue; }
+    if (strcmp(argv[i], "--dump-simplified") == 0) { hoagie_dump_simplified = 1; continue; }
+    if (strcmp(argv[i], "--explain") == 0) { hoagie_explain = 1; continue; }
+    if (strcmp(argv[i], "--compile") == 0 && i+1 < argc) { compile = argv[++i]; continue; }
+    if (strcmp(argv[i], "-o") == 0 && i+1 < argc) { output = argv[++i]; continue; }
+    if (strcmp(argv[i], "--no-jit") == 0) { hoagie_jit = 0; continue; }
+    if (strcmp(argv[i], "--no-trace") == 0) { hoagie_trace = 0; continue; }
+    if (strcmp(argv[i], "--dump-trace") == 0) { hoagie_dump_trace = 1; continue; }
+    if (strcmp(argv[i], "--stats") == 0) { stats = 1; continue; }
+    if (strcmp(argv[i], "--trace-threshold") == 0 && i+1 < argc) {
+      hoagie_trace_threshold = atoi(argv[++i]);
+      continue;
+    }
+    if (strcmp(argv[i], "--jit-threshold") == 0 && i+1 < argc) {
+      hoagie_jit_threshold = atoi(argv[++i]);
+      continue;
+    }
+    files++;
+  }
+
+  /* Translate a program to C instead of running it */
+  if (compile) {
+    mpc_result_t r;
+    if (!mpc_parse_contents(compile, Hoagie, &r)) {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+      return 1;
+    }
+    lval* program = lval_read(r.output);
+    mpc_ast_delete(r.output);
+
+    FILE* out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+      fprintf(stderr, "Could not open '%s' for writing.\n", output);
+      return 1;
+    }
+    lval_compile_c(program, compile, out);
+    if (output) { fclose(out); }
+    lval_del(program);
+    return 0;
+  }
+
+  /* Evaluate each expression in each file, printing the results */
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--engine") == 0) { i++; continue; }
+    if (strcmp(argv[i], "--jit-threshold") == 0) { i++; continue; }
+    if (strcmp(argv[i], "--trace-threshold") == 0) { i++; continue; }
+    if (strcmp(argv[i], "-o") == 0) { i++; continue; }
+    if (strncmp(argv[i], "--", 2) == 0) { continue; }
+
+    mpc_result_t r;
+    if (mpc_parse_contents(argv[i], Hoagie, &r)) {
+      lval* expr = lval_read(r.output);
+      mpc_ast_delete(r.output);
+      while (expr->count) {
+        lval* x = lval_run(e, lval_pop(expr, 0));
+        lval_println(x);
+        lval_del(x);
+      }
+      lval_del(expr);
+    } else {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+    }
+  }
+
+  if (files == 0) {
+    puts("Hoagie Version 0.0.0.10");
+    puts("Press Ctrl+c to Exit\n");
+  }
+
+  while (files == 0) {
   
     char* input = readline("hoagie> ");
+    if (!input) { break; }
     add_history(input);
     
     mpc_result_t r;
     if (mpc_parse("<stdin>", input, Hoagie, &r)) {
-      lval* x = lval_eval(e, lval_read(r.output));
+      lval* x = lval_run(e, lval_read(r.output));
       lval_println(x);
       lval_del(x);
       mpc_ast_delete(r.output);
@@ -657,9 +6086,23 @@ int main(int argc, char** argv) {
     
   }
   
+  if (stats) {
+    fprintf(stderr, "eval steps: %li\n", hoagie_stats.steps);
+    fprintf(stderr, "max eval depth: %i\n", hoagie_stats.max_depth);
+    fprintf(stderr, "max vm depth: %i\n", hoagie_stats.max_vm_depth);
+    fprintf(stderr, "call site cache hits: %li, misses: %li\n",
+      hoagie_stats.cache_hits, hoagie_stats.cache_misses);
+    fprintf(stderr, "jit refused for want of space: %li\n",
+      hoagie_stats.jit_refused);
+  }
+  
+  lcache_flush();
+  lcache_collect();
   lenv_del(e);
   
   mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Hoagie);
   
   return 0;
-}
\ No newline at end of file
+}
+
+#endif
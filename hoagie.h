@@ -0,0 +1,119 @@
+#ifndef hoagie_h
+#define hoagie_h
+
+/* Forward Declarations */
+
+struct lval;
+struct lenv;
+typedef struct lval lval;
+typedef struct lenv lenv;
+struct lchunk;
+
+/* Lisp Value */
+
+enum { LVAL_ERR, LVAL_NUM,   LVAL_SYM,
+       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+
+typedef lval*(*lbuiltin)(lenv*, lval*);
+
+struct lval {
+  int type;
+
+  // Basic
+  long num;
+  char* err;
+  char* sym;
+
+  // Lexical address of a symbol, slot -1 if it is looked up by name
+  int depth;
+  int slot;
+  // Value cell of a symbol resolved to a global
+  lval* global;
+  // Call site cache of a symbol naming a function: a copy of it, taken
+  // when globals had been changed epoch times
+  lval* cached;
+  long epoch;
+
+  // Function
+  lbuiltin builtin;
+  lenv* env;
+  lval* formals;
+  lval* body;
+  struct lchunk* chunk;
+
+  // Expression
+  int count;
+  lval** cell;
+  // Special form an S-Expression was found to be when simplified, or NULL
+  lbuiltin form;
+  // Structural hash of the list, once computed, or 0
+  unsigned long hash;
+};
+
+/*
+ * Runtime interface. Programs translated by 'hoagie --compile' call
+ * these, and link against hoagie.c built with -DHOAGIE_RUNTIME.
+ */
+
+lval* lval_num(long x);
+lval* lval_err(char* fmt, ...);
+lval* lval_sym(char* s);
+lval* lval_sexpr(void);
+lval* lval_qexpr(void);
+lval* lval_add(lval* v, lval* x);
+lval* lval_copy(lval* v);
+void lval_del(lval* v);
+void lval_println(lval* v);
+
+lenv* lenv_new(void);
+void lenv_del(lenv* e);
+lval* lenv_get(lenv* e, lval* k);
+void lenv_add_builtins(lenv* e);
+
+lval* lvm_apply(lenv* e, lbuiltin f, lval** args, int n);
+lval* lvm_call(lenv* e, lval** base, int n);
+lval* lval_test(lval* x, char* form);
+
+lval* builtin_def(lenv* e, lval* a);
+lval* builtin_lambda(lenv* e, lval* a);
+lval* builtin_list(lenv* e, lval* a);
+lval* builtin_head(lenv* e, lval* a);
+lval* builtin_tail(lenv* e, lval* a);
+lval* builtin_eval(lenv* e, lval* a);
+lval* builtin_join(lenv* e, lval* a);
+lval* builtin_len(lenv* e, lval* a);
+lval* builtin_nth(lenv* e, lval* a);
+lval* builtin_last(lenv* e, lval* a);
+lval* builtin_slice(lenv* e, lval* a);
+lval* builtin_sort(lenv* e, lval* a);
+lval* builtin_sort_by(lenv* e, lval* a);
+lval* builtin_uniq(lenv* e, lval* a);
+lval* builtin_bsearch(lenv* e, lval* a);
+lval* builtin_map(lenv* e, lval* a);
+lval* builtin_filter(lenv* e, lval* a);
+lval* builtin_fold(lenv* e, lval* a);
+lval* builtin_reduce(lenv* e, lval* a);
+lval* builtin_take(lenv* e, lval* a);
+lval* builtin_add(lenv* e, lval* a);
+lval* builtin_sub(lenv* e, lval* a);
+lval* builtin_mul(lenv* e, lval* a);
+lval* builtin_div(lenv* e, lval* a);
+lval* builtin_mod(lenv* e, lval* a);
+lval* builtin_lt(lenv* e, lval* a);
+lval* builtin_gt(lenv* e, lval* a);
+lval* builtin_le(lenv* e, lval* a);
+lval* builtin_ge(lenv* e, lval* a);
+lval* builtin_eq(lenv* e, lval* a);
+lval* builtin_ne(lenv* e, lval* a);
+lval* builtin_hash(lenv* e, lval* a);
+lval* builtin_memo(lenv* e, lval* a);
+lval* builtin_memo_stats(lenv* e, lval* a);
+lval* builtin_if(lenv* e, lval* a);
+lval* builtin_cond(lenv* e, lval* a);
+lval* builtin_and(lenv* e, lval* a);
+lval* builtin_or(lenv* e, lval* a);
+lval* builtin_while(lenv* e, lval* a);
+lval* builtin_dotimes(lenv* e, lval* a);
+lval* builtin_for_each(lenv* e, lval* a);
+
+#endif
@@ -0,0 +1,333 @@
+#!/bin/bash
+# Runs programs using the list builtins on every engine, and checks
+# the answers they give, including the errors for arguments which do
+# not suit them.
+#   test/builtins.sh [./hoagie]
+HOAGIE=${1:-./hoagie}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# len, nth, last and slice, on literals and on variables read in place
+cat > "$DIR/read.hg" <<'HG'
+(def {xs} {10 20 30})
+(len {})
+(len xs)
+(len {{1 2} 3})
+(nth 0 {10 20 30})
+(nth 2 xs)
+(nth 3 xs)
+(nth 3 {10 20 30})
+(nth -1 xs)
+(nth -1 {10 20 30})
+(nth 0 {})
+(nth {x} xs)
+(last xs)
+(last {})
+(last {{1 2}})
+(slice 1 3 {1 2 3 4 5})
+(slice 0 2 xs)
+(slice -1 2 xs)
+(slice 1 -2 {1 2 3})
+(slice 2 1 {1 2 3})
+(slice 1 9 xs)
+(slice 3 3 xs)
+(slice 0 0 {})
+(len 5)
+(last 5)
+xs
+(def {f} (\ {i} {nth i xs}))
+(map f {0 1 2})
+(f 5)
+HG
+cat > "$DIR/read.out" <<'OUT'
+()
+0
+3
+2
+10
+30
+Error: Function 'nth' passed index 3 for a list of 3.
+Error: Function 'nth' passed index 3 for a list of 3.
+Error: Function 'nth' passed index -1 for a list of 3.
+Error: Function 'nth' passed index -1 for a list of 3.
+Error: Function 'nth' passed index 0 for a list of 0.
+Error: Function 'nth' passed incorrect type for argument 0. Got Q-Expression, Expected Number.
+30
+Error: Function 'last' passed {} for argument 0.
+{1 2}
+{2 3}
+{10 20}
+Error: Function 'slice' passed negative index -1.
+Error: Function 'slice' passed negative index -2.
+{}
+{20 30}
+{}
+{}
+Error: Function 'len' passed incorrect type for argument 0. Got Number, Expected Q-Expression.
+Error: Function 'last' passed incorrect type for argument 0. Got Number, Expected Q-Expression.
+{10 20 30}
+()
+{10 20 30}
+Error: Function 'nth' passed index 5 for a list of 3.
+OUT
+
+# sort, sort-by, uniq and bsearch. Lists of 32 or more numbers are radix
+# sorted, and of symbols introsorted, so some cases are that long
+cat > "$DIR/sort.hg" <<'HG'
+(sort {})
+(sort {5})
+(sort {3 1 2})
+(sort {-5 3 -100 0 7 -1 9223372036854775807 -9223372036854775808 42})
+(sort {b a c ab})
+(sort {{2 1} {1 3} {1 2} {}})
+(def {ns} {30 -2 -17 5 -17 0 12 -400000 1 99 -3 8 -8 7 -7 6 -6 5 -5 4 -4 3 -3 2 -2 1 -1 0 100 -100 1000 -1000 65536 -65536 16777216 -16777216})
+(sort ns)
+(sort {1 a})
+(sort {{1} 2})
+(sort 5)
+(def {pairs} {{1 a} {0 b} {1 c} {0 d} {1 e} {2 f} {0 g}})
+(sort-by head pairs)
+(sort-by (\ {p} {head p}) pairs)
+(sort-by (\ {x} {% x 3}) {9 1 5 3 4 8 6 7 2})
+(sort-by (\ {x} {0}) {c b a})
+(sort-by head {})
+(sort-by (\ {x} {x}) {1 a})
+(uniq {})
+(uniq {1 1 2 2 2 1 3})
+(uniq {a a {1} {1} b})
+(uniq (sort {3 1 3 2 1}))
+(bsearch 3 {1 2 3 4 5})
+(bsearch 1 {1 2 3 4 5})
+(bsearch 5 {1 2 3 4 5})
+(bsearch 6 {1 2 3 4 5})
+(bsearch 0 {1 2 3 4 5})
+(bsearch 4 {1 3 5})
+(bsearch 1 {})
+(bsearch (nth 1 {a b c}) {a b c})
+(bsearch (nth 0 {bb}) {a b c})
+(bsearch {1} {1 2})
+(def {big} (sort ns))
+(bsearch -17 big)
+(bsearch -18 big)
+(def {is} {0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30 31 32 33 34 35 36 37 38 39})
+(sort-by (\ {i} {- 0 (% i 3)}) is)
+(sort-by (\ {i} {nth (% i 4) {d b a c}}) is)
+(sort (map (\ {i} {- 20 i}) is))
+(sort (map (\ {i} {nth (% i 5) {e d c b a}}) is))
+HG
+cat > "$DIR/sort.out" <<'OUT'
+{}
+{5}
+{1 2 3}
+{-9223372036854775808 -100 -5 -1 0 3 7 42 9223372036854775807}
+{a ab b c}
+Error: Function 'sort' cannot order Q-Expression.
+()
+{-16777216 -400000 -65536 -1000 -100 -17 -17 -8 -7 -6 -5 -4 -3 -3 -2 -2 -1 0 0 1 1 2 3 4 5 5 6 7 8 12 30 99 100 1000 65536 16777216}
+Error: Function 'sort' cannot order Number with Symbol.
+Error: Function 'sort' cannot order Q-Expression.
+Error: Function 'sort' passed incorrect type for argument 0. Got Number, Expected Q-Expression.
+()
+Error: Function 'sort-by' cannot order Q-Expression.
+Error: Function 'sort-by' cannot order Q-Expression.
+{9 3 6 1 4 7 5 8 2}
+{c b a}
+{}
+Error: Function 'sort-by' cannot order Number with Symbol.
+{}
+{1 2 1 3}
+{a {1} b}
+{1 2 3}
+2
+0
+4
+-1
+-1
+-1
+-1
+1
+-1
+Error: Function 'bsearch' passed incorrect type for argument 0. Got Q-Expression, Expected Number or Symbol.
+()
+5
+-1
+()
+{2 5 8 11 14 17 20 23 26 29 32 35 38 1 4 7 10 13 16 19 22 25 28 31 34 37 0 3 6 9 12 15 18 21 24 27 30 33 36 39}
+{2 6 10 14 18 22 26 30 34 38 1 5 9 13 17 21 25 29 33 37 3 7 11 15 19 23 27 31 35 39 0 4 8 12 16 20 24 28 32 36}
+{-19 -18 -17 -16 -15 -14 -13 -12 -11 -10 -9 -8 -7 -6 -5 -4 -3 -2 -1 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20}
+{a a a a a a a a b b b b b b b b c c c c c c c c d d d d d d d d e e e e e e e e}
+OUT
+
+# Ordering numbers, symbols and lists, which is an error between types,
+# and hash, which agrees with ==
+cat > "$DIR/order.hg" <<'HG'
+(< 1 2)
+(>= -3 -3)
+(< (nth 0 {a}) (nth 0 {b}))
+(< (nth 0 {ab}) (nth 0 {a}))
+(<= (nth 0 {abc}) (nth 0 {abc}))
+(< {1 2} {1 3})
+(< {1 2} {1 2 0})
+(> {1 2} {1})
+(< {} {0})
+(<= {} {})
+(> {{1 2} a} {{1 2} a})
+(>= {{1 3}} {{1 2} 9})
+(< {1 a} {1 b})
+(< 1 {1})
+(< {1 2} {1 a})
+(< (nth 0 {a}) 1)
+(< + -)
+(< {1 +} {1 -})
+(< 1 2 3)
+(def {xs} {1 {2 3} a})
+(def {ys} {1 {2 3} a})
+(== xs ys)
+(!= xs ys)
+(== (hash xs) (hash ys))
+(== (hash xs) (hash {1 {2 3} a}))
+(== (hash xs) (hash {1 {2 3} b}))
+(== (hash {1 2}) (hash {2 1}))
+(== (hash {}) (hash {}))
+(== (hash 5) (hash 5))
+(== (hash 5) (hash {5}))
+(def {zs} (join xs {4}))
+(== xs zs)
+(== (hash zs) (hash (join ys {4})))
+(hash 1 2)
+(== (hash +) (hash +))
+(== + +)
+(== (\ {x} {x}) (\ {x} {x}))
+(== (\ {x} {x}) (\ {y} {y}))
+HG
+cat > "$DIR/order.out" <<'OUT'
+1
+1
+1
+0
+1
+1
+1
+1
+1
+1
+0
+1
+1
+Error: Function '<' cannot order Number with Q-Expression.
+Error: Function '<' cannot order Number with Symbol.
+Error: Function '<' cannot order Symbol with Number.
+Error: Function '<' cannot order Function.
+1
+Error: Function '<' passed incorrect number of arguments. Got 3, Expected 2.
+()
+()
+1
+0
+1
+1
+0
+0
+1
+1
+0
+()
+0
+1
+Error: Function 'hash' passed incorrect number of arguments. Got 2, Expected 1.
+1
+1
+1
+0
+OUT
+
+# memo, evicting the least recently used result once it holds as many
+# as its size, and memo-stats: hits, misses, evictions, count and size
+cat > "$DIR/memo.hg" <<'HG'
+(def {sq} (memo (\ {x} {* x x}) 2))
+(memo-stats sq)
+(sq 1)
+(sq 2)
+(sq 1)
+(memo-stats sq)
+(sq 3)
+(memo-stats sq)
+(sq 1)
+(memo-stats sq)
+(sq 2)
+(memo-stats sq)
+(sq 3)
+(memo-stats sq)
+(def {pair} (memo (\ {a b} {list a b})))
+(pair 1 {x})
+(pair 1 {x})
+(pair 1 {y})
+(pair {x} 1)
+(memo-stats pair)
+(def {bad} (memo (\ {x} {/ 1 x})))
+(bad 0)
+(bad 0)
+(memo-stats bad)
+(def {fib} (memo (\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})))
+(fib 90)
+(memo-stats fib)
+(def {fs} (map (\ {k} {memo (\ {x} {+ x k})}) {10 20}))
+(map (\ {g} {g 1}) fs)
+(map (\ {g} {g 1}) fs)
+(map (\ {g} {memo-stats g}) fs)
+(memo-stats +)
+(memo-stats (\ {x} {x}))
+(memo 5)
+(memo + 0)
+HG
+cat > "$DIR/memo.out" <<'OUT'
+()
+{0 0 0 0 2}
+1
+4
+1
+{1 2 0 2 2}
+9
+{1 3 1 2 2}
+1
+{2 3 1 2 2}
+4
+{2 4 2 2 2}
+9
+{2 5 3 2 2}
+()
+{1 {x}}
+{1 {x}}
+{1 {y}}
+{{x} 1}
+{1 3 0 3 1024}
+()
+Error: Division By Zero.
+Error: Division By Zero.
+{1 1 0 1 1024}
+()
+2880067194370816120
+{88 91 0 91 1024}
+()
+{11 21}
+{11 21}
+{{1 1 0 1 1024} {1 1 0 1 1024}}
+Error: Function 'memo-stats' passed a function not made by memo.
+Error: Function 'memo-stats' passed a function not made by memo.
+Error: Function 'memo' passed incorrect type for argument 0. Got Number, Expected Function.
+Error: Function 'memo' passed size 0, Expected at least 1.
+OUT
+
+status=0
+for prog in "$DIR"/*.hg; do
+  for run in "tree" "vm" "vm --jit-threshold 1 --trace-threshold 1" \
+             "vm --no-jit --no-trace"; do
+    "$HOAGIE" --engine $run "$prog" > "$DIR/actual" 2>&1
+    if ! diff -q "${prog%.hg}.out" "$DIR/actual" > /dev/null; then
+      echo "$(basename "$prog" .hg): $run gives wrong answers"
+      diff "${prog%.hg}.out" "$DIR/actual" | head -10
+      status=1
+    fi
+  done
+done
+exit $status
@@ -0,0 +1,79 @@
+#!/bin/bash
+# Runs programs which recurse deeper than the C stack allows, on every
+# engine, and checks each run finishes and carries on afterwards. Where
+# the answer depends on how much stack a build uses per call, the line
+# expected lists both the value and the error, separated by '|'.
+#   test/deep.sh [./hoagie]
+HOAGIE=${1:-./hoagie}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Lambda calls outside tail position, and code run through eval
+cat > "$DIR/calls.hg" <<'HG'
+(def {deep} (\ {n} {if (== n 0) {0} {+ 1 (deep (- n 1))}}))
+(deep 100)
+(deep 100000)
+(def {ev} (\ {n} {if (== n 0) {0} {+ 1 (eval {ev (- n 1)})}}))
+(ev 100000)
+(deep 10)
+HG
+cat > "$DIR/calls.out" <<'OUT'
+()
+100
+100000|Error: Nesting Too Deep.
+()
+100000|Error: Nesting Too Deep.
+10
+OUT
+
+# Functions called back by builtins walking lists
+cat > "$DIR/callbacks.hg" <<'HG'
+(def {deep} (\ {n} {if (== n 0) {0} {+ 1 (fold (\ {a x} {deep (- n 1)}) 0 {1})}}))
+(deep 100)
+(deep 100000)
+(def {up} (\ {n} {if (== n 0) {{0}} {map (\ {x} {+ x 1}) (up (- n 1))}}))
+(up 100000)
+(deep 10)
+HG
+cat > "$DIR/callbacks.out" <<'OUT'
+()
+100
+100000|Error: Nesting Too Deep.
+()
+{100000}|Error: Nesting Too Deep.
+10
+OUT
+
+# Memoized recursion, which keeps nothing from a call that ran out
+cat > "$DIR/memo.hg" <<'HG'
+(def {f} (memo (\ {n} {if (== n 0) {0} {+ 1 (f (- n 1))}}) 100000))
+(f 100000)
+(dotimes {k} 100 {f (* k 1000)})
+(f 100000)
+HG
+cat > "$DIR/memo.out" <<'OUT'
+()
+100000|Error: Nesting Too Deep.
+()
+100000
+OUT
+
+status=0
+for prog in "$DIR"/*.hg; do
+  for run in "tree" "vm" "vm --jit-threshold 1 --trace-threshold 1" \
+             "vm --no-jit --no-trace"; do
+    "$HOAGIE" --engine $run "$prog" > "$DIR/actual" 2>&1
+    code=$?
+    if [ $code -ne 0 ] || ! awk '
+        NR == FNR { want[FNR] = $0; n = FNR; next }
+        { m = FNR; k = split(want[FNR], alt, "|"); ok = 0
+          for (i = 1; i <= k; i++) { if ($0 == alt[i]) { ok = 1 } }
+          if (!ok) { exit 1 } }
+        END { if (m != n) { exit 1 } }' "${prog%.hg}.out" "$DIR/actual"; then
+      echo "$(basename "$prog" .hg): $run failed, exiting with $code"
+      diff "${prog%.hg}.out" "$DIR/actual" | head -10
+      status=1
+    fi
+  done
+done
+exit $status
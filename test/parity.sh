@@ -0,0 +1,84 @@
+#!/bin/bash
+# Runs each program below on the tree engine, then on the VM plain, with
+# the JIT and tracing from the second call, and interpreted only, and
+# reports any output which differs from the tree engine's.
+#   test/parity.sh [./hoagie]
+HOAGIE=${1:-./hoagie}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# and/or on operands which are not numbers, in and out of tail position
+cat > "$DIR/andor.hg" <<'HG'
+(or (and {1} 2) 3)
+(and (or {1} 2) 3)
+(or 0 (and 1 {x}) 3)
+(and 1 (or 0 {x}))
+(dotimes {k} 2 {(and {1} 3)})
+(dotimes {k} 2 {(or {1} 3)})
+(def {f} (\ {a b} {+ 1 (if (and a b) {10} {20})}))
+(f 1 1)
+(f 0 1)
+(f {1} 1)
+(def {g} (\ {a} {list (or a 0) (and a 1)}))
+(g 0)
+(g 5)
+(g {q})
+(def {h} (\ {n} {dotimes {k} n {and k {k}}}))
+(h 3)
+(cond (and 1 {2}) {3} 1 {4})
+(while (or 0 {1}) {1})
+HG
+
+# Self tail-recursive walkers, traced through their branches, leaving
+# through guards on a type or direction not seen when recording
+cat > "$DIR/walk.hg" <<'HG'
+(def {xs} {1 2 3 4 5 6 7 8 9 10 11 12})
+(def {cnt} (\ {l n} {if (== l {}) {n} {cnt (tail l) (+ n 1)}}))
+(dotimes {k} 4 {cnt xs k})
+(def {sum} (\ {l acc} {if (== l {}) {acc} {sum (tail l) (+ acc (eval (head l)))}}))
+(dotimes {k} 4 {sum xs k})
+(sum {1 2 {3}} 0)
+(def {pos} (\ {l} {if (== l {}) {1} {and (> (eval (head l)) 0) (pos (tail l))}}))
+(dotimes {k} 4 {pos xs})
+(pos {1 2 -3 4})
+(def {odd} (\ {n acc} {cond (== n 0) {acc} (== (% n 2) 1) {odd (- n 1) (+ acc 1)} 1 {odd (- n 1) acc}}))
+(odd 100 0)
+(def {f} (\ {n k} {if n {f (- n 1) (+ k 1)} {k}}))
+(f 50 0)
+(f {x} 0)
+(def {loopy} (\ {n} {if (> n 0) {loopy (- n 1) 5} {n}}))
+(loopy 10)
+HG
+
+# A function simplified again after each of many redefinitions, whose
+# old code and traces go back to the JIT's region to be used again
+cat > "$DIR/churn.hg" <<'HG'
+(def {g} (\ {x} {+ x 1}))
+(def {f} (\ {n acc} {if (< n 1) {acc} {f (- n 1) (+ acc (g n))}}))
+(def {round} (\ {k} {list (def {g} (\ {x} {+ x k})) (f 50 0)}))
+(dotimes {k} 3000 {round k})
+(round 7)
+(f 10 0)
+HG
+
+# Lambda bodies with more constants than fit in a 16-bit operand
+ONES=$(printf ' 1%.0s' $(seq 70000))
+cat > "$DIR/wide.hg" <<HG
+(def {f} (\\ {x} {+ x$ONES}))
+(f 1)
+(map f {1 2 3})
+HG
+
+status=0
+for prog in "$DIR"/*.hg; do
+  "$HOAGIE" --engine tree "$prog" > "$DIR/expected" 2>&1
+  for opts in "" "--jit-threshold 2 --trace-threshold 2" "--no-jit --no-trace"; do
+    "$HOAGIE" --engine vm $opts "$prog" > "$DIR/actual" 2>&1
+    if ! diff -q "$DIR/expected" "$DIR/actual" > /dev/null; then
+      echo "$(basename "$prog" .hg): vm $opts differs from tree"
+      diff "$DIR/expected" "$DIR/actual" | head -10
+      status=1
+    fi
+  done
+done
+exit $status
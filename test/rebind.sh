@@ -0,0 +1,83 @@
+#!/bin/bash
+# Runs programs which redefine a function after others were simplified
+# against it, on every engine, and checks the answers they give. Both
+# engines share the simplifier, so comparing them with each other would
+# not notice a stale inlined or folded body.
+#   test/rebind.sh [./hoagie]
+HOAGIE=${1:-./hoagie}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Inlined bodies held by a running frame, a closure, memo and a traced loop
+cat > "$DIR/inline.hg" <<'HG'
+(def {sq} (\ {x} {* x x}))
+(def {h} (\ {y} {- (sq y) 1}))
+(def {run} (\ {g} {list (def {sq} (\ {x} {* x 10})) (g 3)}))
+(run h)
+(def {keep} (\ {g} {\ {y} {g y}}))
+(def {k} (keep h))
+(def {sq} (\ {x} {* x 100}))
+(k 3)
+(def {m} (memo (\ {x} {- (sq x) 1})))
+(m 2)
+(def {sq} (\ {x} {* x 1000}))
+(m 3)
+(def {sum} (\ {n acc} {if (< n 1) {acc} {sum (- n 1) (+ acc (sq n))}}))
+(dotimes {k} 5 {sum 10 0})
+(def {sq} (\ {x} {* x x}))
+(sum 10 0)
+HG
+cat > "$DIR/inline.out" <<'OUT'
+()
+()
+()
+{() 29}
+()
+()
+()
+299
+()
+199
+()
+2999
+()
+()
+()
+385
+OUT
+
+# Folded builtins in a running frame and in closures built before
+cat > "$DIR/fold.hg" <<'HG'
+(def {f} (\ {x} {* x (+ 1 2)}))
+(def {run} (\ {g} {list (def {+} -) (g 10)}))
+(run f)
+(def {+} (\ {& xs} {fold (\ {a b} {- a (- 0 b)}) 0 xs}))
+(def {mk} (\ {a} {\ {x} {+ x a (* 2 3)}}))
+(def {fs} (map mk {1 2}))
+(def {*} +)
+(map (\ {g} {g 1}) fs)
+HG
+cat > "$DIR/fold.out" <<'OUT'
+()
+()
+{() -10}
+()
+()
+()
+()
+{7 8}
+OUT
+
+status=0
+for prog in "$DIR"/*.hg; do
+  for run in "tree" "vm" "vm --jit-threshold 1 --trace-threshold 1" \
+             "vm --no-jit --no-trace"; do
+    "$HOAGIE" --engine $run "$prog" > "$DIR/actual" 2>&1
+    if ! diff -q "${prog%.hg}.out" "$DIR/actual" > /dev/null; then
+      echo "$(basename "$prog" .hg): $run gives stale answers"
+      diff "${prog%.hg}.out" "$DIR/actual" | head -10
+      status=1
+    fi
+  done
+done
+exit $status